@@ -0,0 +1,103 @@
+/**
+ * Plays the notes being held one by one in the ascending order, a step every `pulsesPerStep` pulses of the clock
+ * (16th notes at 24 pulses per quarter), each note lasting `gatePulses`.
+ *
+ * It only decides which notes should start or stop on every pulse, playing them is up to the owner.
+ */
+template<uint8_t capacity>
+class Arpeggiator {
+
+public:
+
+  static const uint8_t NoNote = 0xFF;
+
+  static const uint8_t pulsesPerStep = 6;
+  static const uint8_t gatePulses = 3;
+
+  /** True, if the notes of `midiChannel` should go to the arpeggiator instead of being played directly. */
+  bool enabled;
+
+  uint8_t midiChannel;
+
+  /** The notes being held, in the ascending order. */
+  uint8_t notes[capacity];
+  uint8_t count;
+
+  /** The velocity of the note added last, all the notes are played with it. */
+  uint8_t velocity;
+
+  /** The note that was started last and has not been stopped yet, `NoNote` if none. */
+  uint8_t playing;
+
+  void begin() {
+    enabled = false;
+    midiChannel = 0;
+    count = 0;
+    playing = NoNote;
+    restart();
+  }
+
+  /** Starts from the lowest note on the next pulse. */
+  void restart() {
+    _pulse = 0;
+    _step = 0;
+  }
+
+  /** Adds a held note, returns false if there is no room for it. */
+  bool add(uint8_t note, uint8_t velocity) {
+
+    this->velocity = velocity;
+
+    uint8_t i = 0;
+    while (i < count && notes[i] < note)
+      i++;
+    if (i < count && notes[i] == note)
+      return true;
+    if (count == capacity)
+      return false;
+
+    memmove(notes + i + 1, notes + i, count - i);
+    notes[i] = note;
+    count++;
+    return true;
+  }
+
+  void remove(uint8_t note) {
+    for (uint8_t i = 0; i < count; i++) {
+      if (notes[i] == note) {
+        count--;
+        memmove(notes + i, notes + i + 1, count - i);
+        return;
+      }
+    }
+  }
+
+  /**
+   * Advances by a pulse of the clock. Sets `off` to the note that should be stopped and `on` to the one that should
+   * be started on this pulse, `NoNote` when there are none. The note is stopped first, if both are set.
+   */
+  void pulse(uint8_t& off, uint8_t& on) {
+
+    off = on = NoNote;
+
+    if (playing != NoNote && (_pulse == 0 || _pulse == gatePulses)) {
+      off = playing;
+      playing = NoNote;
+    }
+
+    if (_pulse == 0 && count > 0) {
+      if (_step >= count)
+        _step = 0;
+      on = notes[_step++];
+      playing = on;
+    }
+
+    if (++_pulse == pulsesPerStep)
+      _pulse = 0;
+  }
+
+protected:
+
+  uint8_t _pulse;
+  uint8_t _step;
+};
@@ -0,0 +1,104 @@
+/**
+ * Coalesces MIDI Control Change messages, so floods of them from some controllers don't turn into proportional
+ * amounts of register writes.
+ *
+ * Only the latest value is kept for every (MIDI channel, controller) pair in a small table; the owner takes the changed
+ * ones via `next()` once per tick and applies them. The values overwritten before being applied are counted.
+ */
+template<uint8_t slotCount>
+class Controllers {
+
+  static_assert(slotCount <= 8, "The slots are tracked via 8 bit masks");
+
+public:
+
+  static const uint8_t NoSlot = 0xFF;
+
+  void begin() {
+    used = 0;
+    pending = 0;
+  }
+
+  /**
+   * Remembers the latest value of the controller. Returns false if there is no room for it in the table,
+   * i.e. all the slots have values that have not been applied yet, so the caller should apply it right away.
+   */
+  bool set(uint8_t channel, uint8_t control, uint8_t value) {
+
+    uint8_t slot = _find(channel, control);
+
+    if (slot == NoSlot) {
+      // Any slot which is not waiting to be applied can be taken.
+      uint8_t available = ~pending & SlotsMask;
+      if (!available) {
+#if OPL3BOX_STATS
+        stats.overflows++;
+#endif
+        return false;
+      }
+      slot = __builtin_ctz(available);
+      this->channel[slot] = channel;
+      this->control[slot] = control;
+      used |= _BV(slot);
+    } else if (pending & _BV(slot)) {
+      if (this->value[slot] == value)
+        return true;
+#if OPL3BOX_STATS
+      stats.dropped++;
+#endif
+    }
+
+    this->value[slot] = value;
+    pending |= _BV(slot);
+    return true;
+  }
+
+  /** Takes the next changed controller, returns false if there are no more. */
+  bool next(uint8_t& channel, uint8_t& control, uint8_t& value) {
+    if (!pending)
+      return false;
+    uint8_t slot = __builtin_ctz(pending);
+    pending &= ~_BV(slot);
+    channel = this->channel[slot];
+    control = this->control[slot];
+    value = this->value[slot];
+#if OPL3BOX_STATS
+    stats.applied++;
+#endif
+    return true;
+  }
+
+#if OPL3BOX_STATS
+  struct Stats {
+    /** Values that were overwritten by newer ones before being applied. */
+    uint16_t dropped;
+    /** Values that were applied via `next()`. */
+    uint16_t applied;
+    /** Values that did not fit into the table and were applied right away. */
+    uint16_t overflows;
+  };
+  Stats stats;
+#endif
+
+protected:
+
+  static const uint8_t SlotsMask = (slotCount >= 8) ? 0xFF : (_BV(slotCount) - 1);
+
+  uint8_t channel[slotCount];
+  uint8_t control[slotCount];
+  uint8_t value[slotCount];
+
+  /** Slots that have a controller assigned. */
+  uint8_t used;
+
+  /** Slots with values that have not been applied yet. */
+  uint8_t pending;
+
+  uint8_t _find(uint8_t channel, uint8_t control) const {
+    for (uint8_t slot = 0; slot < slotCount; slot++) {
+      if ((used & _BV(slot)) && this->control[slot] == control && this->channel[slot] == channel)
+        return slot;
+    }
+    return NoSlot;
+  }
+};
@@ -0,0 +1,93 @@
+/**
+ * The drum kit: General MIDI drum notes (channel 10) from `FirstDrumNote` (Acoustic Bass Drum) to Open Triangle.
+ *
+ * Every note is either one of the rhythm instruments of the chip (see `OPL3::Rhythm`) or a drum patch played
+ * on a regular voice (see `drumPatches`), at a fixed pitch either way, so a hit is a copy of a few bytes. The notes
+ * of the same choke group cut each other, e.g. a closed hi-hat cuts an open one.
+ */
+struct DrumNote {
+  /** The index of the patch in `drumPatches`, or `DrumRhythm` plus the bit of the rhythm instrument. */
+  uint8_t patch;
+  /** The choke groups of the note, see `DrumChoke`. */
+  uint8_t chokeGroups;
+  /** 
+   * The pitch, packed like in the tuning tables. The rhythm instruments share the pitches of their channels, 0 keeps
+   * the one there, see `OPL3::Rhythm`.
+   */
+  uint16_t blockAndFnumber;
+};
+
+static const uint8_t DrumRhythm = 0x80;
+
+enum DrumChoke : uint8_t {
+  ChokeHiHat = 0x01,
+  ChokeWhistle = 0x02,
+  ChokeGuiro = 0x04,
+  ChokeCuica = 0x08,
+  ChokeTriangle = 0x10
+};
+
+#define DRUM(patch, chokeGroups, freq) { (patch), (chokeGroups), OPL3::blockAndFnumberFor(freq) }
+#define RHYTHM_DRUM(instrument, freq) { DrumRhythm | (instrument), 0, OPL3::blockAndFnumberFor(freq) }
+
+static const uint8_t FirstDrumNote = 35;
+
+static const DrumNote drumMap[] PROGMEM = {
+  // 35: Acoustic Bass Drum, Bass Drum 1, Side Stick, Acoustic Snare, Hand Clap, Electric Snare.
+  RHYTHM_DRUM(OPL3::RhythmBassDrum, 55),
+  RHYTHM_DRUM(OPL3::RhythmBassDrum, 65),
+  DRUM(DrumPatchWood, 0, 420),
+  RHYTHM_DRUM(OPL3::RhythmSnareDrum, 0),
+  DRUM(DrumPatchClosedHiHat, 0, 600),
+  RHYTHM_DRUM(OPL3::RhythmSnareDrum, 0),
+  // 41: Low Floor Tom, Closed Hi-Hat, High Floor Tom, Pedal Hi-Hat, Low Tom, Open Hi-Hat.
+  RHYTHM_DRUM(OPL3::RhythmTomTom, 87),
+  DRUM(DrumPatchClosedHiHat, ChokeHiHat, 1000),
+  RHYTHM_DRUM(OPL3::RhythmTomTom, 98),
+  DRUM(DrumPatchClosedHiHat, ChokeHiHat, 700),
+  RHYTHM_DRUM(OPL3::RhythmTomTom, 110),
+  DRUM(DrumPatchOpenHiHat, ChokeHiHat, 1000),
+  // 47: Low-Mid Tom, Hi-Mid Tom, Crash Cymbal 1, High Tom, Ride Cymbal 1, Chinese Cymbal, Ride Bell.
+  RHYTHM_DRUM(OPL3::RhythmTomTom, 131),
+  RHYTHM_DRUM(OPL3::RhythmTomTom, 147),
+  RHYTHM_DRUM(OPL3::RhythmCymbal, 0),
+  RHYTHM_DRUM(OPL3::RhythmTomTom, 165),
+  RHYTHM_DRUM(OPL3::RhythmCymbal, 0),
+  RHYTHM_DRUM(OPL3::RhythmCymbal, 0),
+  DRUM(DrumPatchBell, 0, 620),
+  // 54: Tambourine, Splash Cymbal, Cowbell, Crash Cymbal 2, Vibraslap, Ride Cymbal 2.
+  DRUM(DrumPatchClosedHiHat, 0, 1400),
+  RHYTHM_DRUM(OPL3::RhythmCymbal, 0),
+  DRUM(DrumPatchMetal, 0, 560),
+  RHYTHM_DRUM(OPL3::RhythmCymbal, 0),
+  DRUM(DrumPatchBell, 0, 300),
+  RHYTHM_DRUM(OPL3::RhythmCymbal, 0),
+  // 60: Hi Bongo, Low Bongo, Mute Hi Conga, Open Hi Conga, Low Conga, High Timbale, Low Timbale.
+  DRUM(DrumPatchSkin, 0, 400),
+  DRUM(DrumPatchSkin, 0, 300),
+  DRUM(DrumPatchSkin, 0, 350),
+  DRUM(DrumPatchSkin, 0, 330),
+  DRUM(DrumPatchSkin, 0, 220),
+  DRUM(DrumPatchSkin, 0, 520),
+  DRUM(DrumPatchSkin, 0, 390),
+  // 67: High Agogo, Low Agogo, Cabasa, Maracas, Short Whistle, Long Whistle.
+  DRUM(DrumPatchMetal, 0, 900),
+  DRUM(DrumPatchMetal, 0, 670),
+  DRUM(DrumPatchClosedHiHat, 0, 1500),
+  DRUM(DrumPatchClosedHiHat, 0, 2000),
+  DRUM(DrumPatchTone, ChokeWhistle, 2300),
+  DRUM(DrumPatchTone, ChokeWhistle, 2000),
+  // 73: Short Guiro, Long Guiro, Claves, Hi Wood Block, Low Wood Block.
+  DRUM(DrumPatchClosedHiHat, ChokeGuiro, 600),
+  DRUM(DrumPatchOpenHiHat, ChokeGuiro, 600),
+  DRUM(DrumPatchWood, 0, 2500),
+  DRUM(DrumPatchWood, 0, 1000),
+  DRUM(DrumPatchWood, 0, 800),
+  // 78: Mute Cuica, Open Cuica, Mute Triangle, Open Triangle.
+  DRUM(DrumPatchTone, ChokeCuica, 600),
+  DRUM(DrumPatchTone, ChokeCuica, 450),
+  DRUM(DrumPatchMetal, ChokeTriangle, 2600),
+  DRUM(DrumPatchBell, ChokeTriangle, 2600)
+};
+
+static const uint8_t DrumNoteCount = sizeof(drumMap) / sizeof(drumMap[0]);
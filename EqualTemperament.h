@@ -0,0 +1,21 @@
+// Generated by tools/tuning.py, do not edit.
+
+/** 12-tone equal temperament, A4 = 440Hz. The block in bits 10-12, the f-number in bits 0-9, see `Tunings`. */
+const uint16_t EqualTemperament[128] PROGMEM = {
+  0x00AC, 0x00B7, 0x00C2, 0x00CD, 0x00D9, 0x00E6, 0x00F4, 0x0102,
+  0x0112, 0x0122, 0x0133, 0x0146, 0x0159, 0x016D, 0x0183, 0x019A,
+  0x01B3, 0x01CC, 0x01E8, 0x0205, 0x0223, 0x0244, 0x0267, 0x028B,
+  0x02B2, 0x02DB, 0x0306, 0x0334, 0x0365, 0x0399, 0x03CF, 0x0605,
+  0x0623, 0x0644, 0x0667, 0x068B, 0x06B2, 0x06DB, 0x0706, 0x0734,
+  0x0765, 0x0799, 0x07CF, 0x0A05, 0x0A23, 0x0A44, 0x0A67, 0x0A8B,
+  0x0AB2, 0x0ADB, 0x0B06, 0x0B34, 0x0B65, 0x0B99, 0x0BCF, 0x0E05,
+  0x0E23, 0x0E44, 0x0E67, 0x0E8B, 0x0EB2, 0x0EDB, 0x0F06, 0x0F34,
+  0x0F65, 0x0F99, 0x0FCF, 0x1205, 0x1223, 0x1244, 0x1267, 0x128B,
+  0x12B2, 0x12DB, 0x1306, 0x1334, 0x1365, 0x1399, 0x13CF, 0x1605,
+  0x1623, 0x1644, 0x1667, 0x168B, 0x16B2, 0x16DB, 0x1706, 0x1734,
+  0x1765, 0x1799, 0x17CF, 0x1A05, 0x1A23, 0x1A44, 0x1A67, 0x1A8B,
+  0x1AB2, 0x1ADB, 0x1B06, 0x1B34, 0x1B65, 0x1B99, 0x1BCF, 0x1E05,
+  0x1E23, 0x1E44, 0x1E67, 0x1E8B, 0x1EB2, 0x1EDB, 0x1F06, 0x1F34,
+  0x1F65, 0x1F99, 0x1FCF, 0x1FFF, 0x1FFF, 0x1FFF, 0x1FFF, 0x1FFF,
+  0x1FFF, 0x1FFF, 0x1FFF, 0x1FFF, 0x1FFF, 0x1FFF, 0x1FFF, 0x1FFF,
+};
@@ -0,0 +1,77 @@
+/**
+ * Shifts block/f-number pairs (packed as in the tuning tables, see `Tunings`) by fractions of a semitone using integer
+ * math only: pitch bends, detune, etc.
+ *
+ * Offsets are in fine steps, 1/64 of a semitone (~1.6 cents), which is about the resolution of the f-number itself
+ * in the upper half of its range. The ratio is split into whole octaves (the block), semitones and fine steps,
+ * the last two are looked up in small tables of 2^x in Q15.
+ */
+class FinePitch {
+
+public:
+
+  static const uint8_t StepsPerSemitone = 64;
+  static const uint16_t StepsPerOctave = 12 * StepsPerSemitone;
+
+  /** The block and f-number shifted by the given number of fine steps, clamped to the range of the chip. */
+  static uint16_t shifted(uint16_t blockAndFnumber, int16_t steps) {
+
+    if (steps == 0)
+      return blockAndFnumber;
+
+    // Floor division, so the rest is always positive.
+    int8_t octaves = (steps >= 0) ? steps / StepsPerOctave : -(int8_t)((-steps + StepsPerOctave - 1) / StepsPerOctave);
+    uint16_t rest = steps - (int16_t)octaves * StepsPerOctave;
+
+    // A few extra bits, so the truncations do not add up and the result can be moved to a lower block precisely.
+    uint32_t f = (uint32_t)(blockAndFnumber & 0x3FF) << ExtraBits;
+    f = (f * pgm_read_word(semitoneRatios + rest / StepsPerSemitone)) >> 15;
+    f = (f * pgm_read_word(fineRatios + rest % StepsPerSemitone)) >> 15;
+
+    int8_t block = (blockAndFnumber >> 10) + octaves;
+    while (f >= ((uint32_t)0x400 << ExtraBits)) {
+      f >>= 1;
+      block++;
+    }
+    // The f-number is the most precise in the upper half of its range.
+    while (f < ((uint32_t)0x200 << ExtraBits) && block > 0) {
+      f <<= 1;
+      block--;
+    }
+    f = (f + (1 << (ExtraBits - 1))) >> ExtraBits;
+    if (f >= 0x400) {
+      f >>= 1;
+      block++;
+    }
+    if (block < 0) {
+      f = (-block >= 10) ? 0 : f >> -block;
+      block = 0;
+    } else if (block > 7) {
+      f = 0x3FF;
+      block = 7;
+    }
+
+    return ((uint16_t)block << 10) | f;
+  }
+
+protected:
+
+  static const uint8_t ExtraBits = 5;
+
+  /** 2^(s / 12) for s = 0..11, Q15. */
+  static const uint16_t semitoneRatios[12];
+
+  /** 2^(f / 768) for f = 0..63, Q15. */
+  static const uint16_t fineRatios[StepsPerSemitone];
+};
+
+const uint16_t FinePitch::semitoneRatios[12] PROGMEM = {
+  32768, 34716, 36781, 38968, 41285, 43740, 46341, 49097, 52016, 55109, 58386, 61858
+};
+
+const uint16_t FinePitch::fineRatios[FinePitch::StepsPerSemitone] PROGMEM = {
+  32768, 32798, 32827, 32857, 32887, 32916, 32946, 32976, 33005, 33035, 33065, 33095, 33125, 33155, 33185, 33215,
+  33245, 33275, 33305, 33335, 33365, 33395, 33425, 33455, 33486, 33516, 33546, 33576, 33607, 33637, 33667, 33698,
+  33728, 33759, 33789, 33820, 33850, 33881, 33911, 33942, 33973, 34003, 34034, 34065, 34095, 34126, 34157, 34188,
+  34219, 34250, 34281, 34312, 34343, 34374, 34405, 34436, 34467, 34498, 34529, 34560, 34591, 34623, 34654, 34685
+};
@@ -0,0 +1,94 @@
+/**
+ * Watches the load (the depth of the bulk write queue and the time the main loop takes) and decides how much
+ * to degrade modulation, so it's the modulation that suffers when the chip cannot keep up, not the notes.
+ *
+ * Every level above 0 halves the rate of modulation updates (controllers, etc) and makes controllers coarser,
+ * so more of their values are coalesced. Key events are never delayed by the governor, they go via the urgent
+ * writes anyway.
+ */
+class Governor {
+
+public:
+
+  static const uint8_t MaxLevel = 3;
+
+  /** The current degradation level, 0 is normal. */
+  uint8_t level;
+
+  /** The average duration of the main loop, microseconds. */
+  uint16_t loopMicros;
+
+#if OPL3BOX_STATS
+  /** The highest level reached so far. */
+  uint8_t maxLevel;
+#endif
+
+  void begin() {
+    level = 0;
+    loopMicros = 0;
+    _calmTicks = 0;
+    _tick = 0;
+    _prevLoop = micros();
+  }
+
+  /** Should be called on every iteration of the main loop. */
+  void loop() {
+    uint16_t now = micros();
+    uint16_t duration = now - _prevLoop;
+    _prevLoop = now;
+    // A simple moving average, 1/8 of every new sample.
+    loopMicros += ((int16_t)(duration - loopMicros)) >> 3;
+  }
+
+  /** Should be called every tick with the current state of the write queue, adjusts the level. */
+  void tick(uint8_t queueDepth, uint8_t queueCapacity) {
+
+    _tick++;
+
+    bool overloaded = queueDepth >= queueCapacity - queueCapacity / 4 || loopMicros >= overloadedLoopMicros;
+    bool calm = queueDepth <= queueCapacity / 4 && loopMicros < calmLoopMicros;
+
+    if (overloaded) {
+      _calmTicks = 0;
+      if (level < MaxLevel) {
+        level++;
+#if OPL3BOX_STATS
+        if (level > maxLevel)
+          maxLevel = level;
+#endif
+      }
+    } else if (calm && level > 0) {
+      // Going back one level at a time and not too quickly, so it does not oscillate.
+      if (++_calmTicks >= calmTicksPerLevel) {
+        _calmTicks = 0;
+        level--;
+      }
+    } else {
+      _calmTicks = 0;
+    }
+  }
+
+  /** True, if modulation should be updated on this tick, i.e. every tick on level 0, every other tick on level 1, etc. */
+  bool modulationTick() const {
+    return (_tick & ((1 << level) - 1)) == 0;
+  }
+
+  /** Reduces the resolution of a 7 bit controller value according to the current level, keeping the maximum intact. */
+  uint8_t quantize(uint8_t value) const {
+    if (value == 0x7F)
+      return value;
+    return value & ~((1 << level) - 1);
+  }
+
+protected:
+
+  /** Loops longer than this mean that MIDI input might be delayed. */
+  static const uint16_t overloadedLoopMicros = 2000;
+  static const uint16_t calmLoopMicros = 1000;
+
+  static const uint8_t calmTicksPerLevel = 25;
+
+  uint8_t _calmTicks;
+  uint8_t _tick;
+  uint16_t _prevLoop;
+};
@@ -0,0 +1,98 @@
+/**
+ * A layout of key zones in the program memory starts with the number of zones, see `KEY_ZONES()`, followed by the zones.
+ *
+ * Every zone is 7 bytes: the MIDI channel (0-15), the lowest and the highest notes, the lowest and the highest
+ * velocities, the transposition in semitones and the number of parameter locks, followed by the locks themselves,
+ * 2 bytes each, see `KEY_ZONE()` and `KEY_ZONE_LOCK()`. The locks are the same as the ones of the sequencer steps.
+ */
+#define KEY_ZONES(count) (count)
+#define KEY_ZONE(channel, low, high, minVelocity, maxVelocity, transpose, locks) \
+  (channel), (low), (high), (minVelocity), (maxVelocity), (uint8_t)(transpose), (locks)
+#define KEY_ZONE_LOCK(parameter, value) (parameter), (value)
+
+/**
+ * Keyboard splits and layers: a note played on a MIDI channel with zones plays once for every zone of the channel
+ * covering it (and its velocity), transposed and with the parameter locks of the zone.
+ *
+ * The zones covering every note are precomputed into a table of bitmasks when a layout is loaded, so resolving them
+ * on a note on is a single lookup no matter how many zones there are. The zones themselves stay in the program memory.
+ */
+template<uint8_t maxZones, uint8_t maxLocks>
+class KeyZones {
+
+  static_assert(maxZones <= 8, "The zones are tracked via 8 bit masks");
+
+public:
+
+  struct Zone {
+    uint8_t minVelocity;
+    uint8_t maxVelocity;
+    int8_t transpose;
+    uint8_t lockCount;
+    /** Parameter and value pairs. */
+    uint8_t locks[maxLocks * 2];
+  };
+
+  /** The zones covering every note, regardless of their channels; one bit per zone. */
+  uint8_t noteZones[128];
+
+  /** The zones of every MIDI channel. */
+  uint8_t channelZones[16];
+
+  void begin() {
+    memset(noteZones, 0, sizeof(noteZones));
+    memset(channelZones, 0, sizeof(channelZones));
+  }
+
+  /** Replaces the zones with the ones of the layout, see above. The zones beyond `maxZones` are ignored. */
+  void load(const uint8_t *layout) {
+
+    begin();
+
+    uint8_t count = pgm_read_byte(layout++);
+    for (uint8_t i = 0; i < count; i++) {
+
+      uint8_t channel = pgm_read_byte(layout);
+      uint8_t low = pgm_read_byte(layout + 1);
+      uint8_t high = pgm_read_byte(layout + 2);
+
+      if (i < maxZones && channel < 16) {
+        _zones[i] = layout + 3;
+        channelZones[channel] |= _BV(i);
+        for (uint8_t note = low; note <= high && note < 128; note++)
+          noteZones[note] |= _BV(i);
+      }
+
+      layout += 7 + pgm_read_byte(layout + 6) * 2;
+    }
+  }
+
+  /** True, if the notes of the channel are played via zones; the notes no zone covers are not played then. */
+  bool hasZones(uint8_t channel) const {
+    return channelZones[channel];
+  }
+
+  /** The zones of the channel covering the note, one bit per zone. */
+  uint8_t zonesFor(uint8_t channel, uint8_t note) const {
+    return noteZones[note] & channelZones[channel];
+  }
+
+  /** Reads the zone with the given index, which should be among the ones returned by `zonesFor()`. */
+  void read(uint8_t index, Zone& zone) const {
+
+    const uint8_t *p = _zones[index];
+    zone.minVelocity = pgm_read_byte(p);
+    zone.maxVelocity = pgm_read_byte(p + 1);
+    zone.transpose = pgm_read_byte(p + 2);
+
+    uint8_t lockCount = pgm_read_byte(p + 3);
+    zone.lockCount = (lockCount <= maxLocks) ? lockCount : maxLocks;
+    for (uint8_t i = 0; i < zone.lockCount * 2; i++)
+      zone.locks[i] = pgm_read_byte(p + 4 + i);
+  }
+
+protected:
+
+  /** Where the zones start in the layout, past their channels and notes. */
+  const uint8_t *_zones[maxZones];
+};
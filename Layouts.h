@@ -0,0 +1,21 @@
+/**
+ * Layouts of key zones, see `KeyZones.h` for the format. The parameter locks are the ones of the sequencer, see `Patterns.h`.
+ */
+
+/**
+ * MIDI channel 3: a bass an octave down below the middle C, the plain patch from it up, with an octave up layer
+ * for the notes played hard.
+ */
+static const uint8_t demoLayout[] PROGMEM = {
+
+  KEY_ZONES(3),
+
+  KEY_ZONE(2, 0, 59, 1, 127, -12, 1),
+    KEY_ZONE_LOCK(LockFeedback, 6),
+
+  KEY_ZONE(2, 60, 127, 1, 127, 0, 0),
+
+  KEY_ZONE(2, 60, 127, 100, 127, 12, 2),
+    KEY_ZONE_LOCK(LockModulatorMult, 2),
+    KEY_ZONE_LOCK(LockCarrierWaveform, 1)
+};
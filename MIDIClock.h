@@ -0,0 +1,143 @@
+/**
+ * Follows MIDI clock (24 pulses per quarter note, Start/Continue/Stop) and runs an internal clock locked to it, so
+ * whatever is driven by the internal clock does not inherit the jitter of the incoming pulses (USB polling, pulses
+ * waiting behind other MIDI bytes or a busy main loop, etc).
+ *
+ * The interval between the incoming pulses is smoothed with a moving average. The owner ticks the internal clock
+ * from a timer every `nextIntervalMicros()`. The internal clock can run one pulse ahead of the incoming ones at most;
+ * when it falls behind, it runs a bit faster till it catches up, so it stays in sync with the master without
+ * following every wobble of it.
+ */
+class MIDIClock {
+
+public:
+
+  static const uint8_t PulsesPerQuarter = 24;
+
+  /** The interval used till the first pulses are received, 120 BPM. */
+  static const uint32_t defaultPulseMicros = 60000000UL / (120 * PulsesPerQuarter);
+
+  /** Longer intervals are gaps in the clock rather than a tempo, 10 BPM. */
+  static const uint32_t maxPulseMicros = 60000000UL / (10 * PulsesPerQuarter);
+
+  /** True after Start/Continue (or `startInternal()`) and till Stop. */
+  bool running;
+
+  /** True, if following the incoming pulses, false if running on its own from the last known tempo. */
+  bool external;
+
+  /** The smoothed interval between incoming pulses, microseconds, 0 if not known yet. */
+  uint32_t pulseMicros;
+
+#if OPL3BOX_STATS
+  /** How many pulses the internal clock fell behind the master at most. */
+  int8_t maxLag;
+#endif
+
+  void begin() {
+    running = false;
+    external = false;
+    pulseMicros = 0;
+    _hasLastPulse = false;
+    _lag = 0;
+    _waiting = false;
+  }
+
+  /** 0xFA and 0xFB. The internal clock waits for the first pulse after either. */
+  void start() {
+    running = true;
+    external = true;
+    _lag = 0;
+    _waiting = true;
+  }
+
+  /** Runs without a master, e.g. when the box is used standalone; Start switches to following the master. */
+  void startInternal() {
+    running = true;
+    external = false;
+  }
+
+  /** 0xFC. */
+  void stop() {
+    running = false;
+  }
+
+  /**
+   * 0xF8, `now` is the value of `micros()`. Returns true if the internal clock was waiting for this pulse,
+   * so the owner should tick it right away instead of waiting for the timer.
+   */
+  bool pulse(uint32_t now) {
+
+    if (_hasLastPulse) {
+      uint32_t interval = now - _lastPulse;
+      if (interval <= maxPulseMicros) {
+        if (pulseMicros == 0) {
+          pulseMicros = interval;
+        } else {
+          // A simple moving average, 1/8 of every new sample.
+          pulseMicros += ((int32_t)interval - (int32_t)pulseMicros) >> 3;
+        }
+      }
+    }
+    _lastPulse = now;
+    _hasLastPulse = true;
+
+    if (!running || !external)
+      return false;
+
+    if (_lag < 127)
+      _lag++;
+#if OPL3BOX_STATS
+    if (_lag > maxLag)
+      maxLag = _lag;
+#endif
+
+    if (_waiting) {
+      _waiting = false;
+      return true;
+    }
+    return false;
+  }
+
+  /** Should be called on every tick of the internal clock, returns false if it should not advance as it's ahead already. */
+  bool tick() {
+    if (!running)
+      return false;
+    if (!external)
+      return true;
+    if (_lag < 0) {
+      _waiting = true;
+      return false;
+    }
+    _lag--;
+    return true;
+  }
+
+  /** The interval between the pulses, microseconds, the default one till it's known. */
+  uint32_t pulseInterval() const {
+    return pulseMicros ? pulseMicros : defaultPulseMicros;
+  }
+
+  /** When the internal clock should tick next, microseconds since the current tick. */
+  uint32_t nextIntervalMicros() const {
+    uint32_t interval = pulseInterval();
+    // Catching up when behind.
+    return (external && _lag > 0) ? interval - (interval >> 3) : interval;
+  }
+
+  /** The current tempo, beats per minute. */
+  uint16_t bpm() const {
+    return 60000000UL / PulsesPerQuarter / pulseInterval();
+  }
+
+protected:
+
+  uint32_t _lastPulse;
+  bool _hasLastPulse;
+
+  /** Incoming pulses minus the ticks of the internal clock. */
+  int8_t _lag;
+
+  /** True, if the internal clock was not allowed to advance on the last tick. */
+  bool _waiting;
+};
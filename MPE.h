@@ -0,0 +1,85 @@
+/**
+ * MIDI Polyphonic Expression zones: the lower one is managed via channel 1 (index 0) and its member channels go up
+ * from channel 2, the upper one is managed via channel 16 (index 15) and its member channels go down from channel 15.
+ * A zone is set up by the MPE Configuration Message (RPN 6) on its master channel, 0 member channels turn it off.
+ *
+ * Every note of a zone comes on a member channel of its own, so the bend and pressure of a member channel are
+ * the ones of its note; the bend of the master channel applies to the whole zone.
+ */
+class MPEZones {
+
+public:
+
+  static const uint8_t NoChannel = 0xFF;
+
+  static const uint8_t LowerMaster = 0;
+  static const uint8_t UpperMaster = 15;
+
+  /** Member channels of both zones. */
+  uint16_t members;
+
+  void begin() {
+    _lowerCount = 0;
+    _upperCount = 0;
+    members = 0;
+  }
+
+  /**
+   * Handles the MPE Configuration Message received on the given channel. Returns false if the channel is not
+   * a master channel. The zone set up last wins the channels both zones want.
+   */
+  bool configure(uint8_t channel, uint8_t memberCount) {
+
+    if (memberCount > 15)
+      memberCount = 15;
+
+    if (channel == LowerMaster) {
+      _lowerCount = memberCount;
+      if (_upperCount + _lowerCount > 14)
+        _upperCount = (_lowerCount >= 14) ? 0 : 14 - _lowerCount;
+    } else if (channel == UpperMaster) {
+      _upperCount = memberCount;
+      if (_upperCount + _lowerCount > 14)
+        _lowerCount = (_upperCount >= 14) ? 0 : 14 - _upperCount;
+    } else {
+      return false;
+    }
+
+    // 15 members is a single zone taking all the channels but the master.
+    uint16_t lower = (_lowerCount >= 15) ? 0xFFFE : (uint16_t)(((1 << _lowerCount) - 1) << 1);
+    uint16_t upper = (_upperCount >= 15) ? 0x7FFF : (uint16_t)(((1 << _upperCount) - 1) << (15 - _upperCount));
+    members = lower | upper;
+    return true;
+  }
+
+  bool isMember(uint8_t channel) const {
+    return members & _BV(channel);
+  }
+
+  bool isMaster(uint8_t channel) const {
+    return (channel == LowerMaster && _lowerCount) || (channel == UpperMaster && _upperCount);
+  }
+
+  /** The master channel of the zone the channel is a member of, `NoChannel` if it's not a member. */
+  uint8_t masterFor(uint8_t channel) const {
+    if (!isMember(channel))
+      return NoChannel;
+    return (_lowerCount && channel <= _lowerCount) ? LowerMaster : UpperMaster;
+  }
+
+  /** The channels plus the members of the zones whose master channels are among them. */
+  uint16_t withMembers(uint16_t channels) const {
+    uint16_t result = channels;
+    for (uint16_t m = members; m; m &= m - 1) {
+      uint8_t channel = __builtin_ctz(m);
+      if (channels & _BV(masterFor(channel)))
+        result |= _BV(channel);
+    }
+    return result;
+  }
+
+protected:
+
+  uint8_t _lowerCount;
+  uint8_t _upperCount;
+};
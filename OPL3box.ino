@@ -4,10 +4,47 @@
 // This is made for Arduino Pro Micro, so MIDI over USB can be used, but Uno/Nano will work with pin number changes.
 
 #include "MIDIUSB.h"
+#include <util/atomic.h>
+
+// Set to 1 to collect counters about the chip bus and the rest of the pipeline, handy when optimizing things.
+#ifndef OPL3BOX_STATS
+#define OPL3BOX_STATS 0
+#endif
 
 #include <a21.hpp>
 using namespace a21;
 
+/** 
+ * A bit field within an array of register values: the index of the register, the shift and the width of the field in bits. 
+ * Unlike C bitfields the layout is explicit and every access is a single read-modify-write of one byte.
+ */
+template<uint8_t regIndex, uint8_t fieldShift, uint8_t fieldWidth>
+struct RegisterField {
+
+  static constexpr uint8_t index = regIndex;
+  static constexpr uint8_t shift = fieldShift;
+  static constexpr uint8_t width = fieldWidth;
+
+  /** The maximum value of the field. */
+  static constexpr uint8_t max = (1 << fieldWidth) - 1;
+
+  /** The mask of the field within its register. */
+  static constexpr uint8_t mask = max << fieldShift;
+
+  static inline uint8_t get(const uint8_t *regs) {
+    return (regs[regIndex] & mask) >> fieldShift;
+  }
+
+  static inline void set(uint8_t *regs, uint8_t value) {
+    regs[regIndex] = put(regs[regIndex], value);
+  }
+
+  /** The register value with the field set, usable in constant expressions, see `OperatorBuilder`. */
+  static constexpr uint8_t put(uint8_t reg, uint8_t value) {
+    return (reg & ~mask) | ((value << fieldShift) & mask);
+  }
+};
+
 /** 
  * Low level wrapper for an OPL3 chip (YM262).
  * Parameters: 
@@ -40,46 +77,144 @@ protected:
     _delay_us(delayMultiple * 0.020);      
   }
 
+public:
+
+#if OPL3BOX_STATS
+  /** Bus counters, allow to see how effective the write path is. */
+  struct Stats {
+    /** Total number of the register writes. */
+    uint16_t writes;
+    /** How many times A1 had to be switched to select a different register set. */
+    uint16_t registerSetSwitches;
+    /** Writes that could skip the address phase as the register was latched already. */
+    uint16_t addressSkips;
+  };
+
+  static const Stats& stats() { return _stats; }
+
+  static void resetStats() { memset(&_stats, 0, sizeof(_stats)); }
+#endif
+
+protected:
+
+  /** The register (including the register set bit) latched by the last address write, or `NoRegister` when unknown. */
+  static uint16_t _lastReg;
+
+  static const uint16_t NoRegister = 0xFFFF;
+
+#if OPL3BOX_STATS
+  static Stats _stats;
+#endif
+
 public:
 
   static void write(uint16_t reg, uint8_t data) {
     
     // Always assuming that the bus is in inactive state.
 
-    // Address mode.
-    pinA0::setLow();
+    // The chip keeps the address latched, so consecutive writes into the same register need the data phase only.
+    if (reg != _lastReg) {
 
-    // Select register set 0 or 1.
-    pinA1::write((reg >> 8) & 1);
+      // Address mode.
+      pinA0::setLow();
 
-    // Address setup time, Tas = 10ns. (This is too short, but let's put it here just in case and for documentation.)
-    _delay_us(delayMultiple * 0.010);
+      // Select register set 0 or 1, unless it is already there. A1 is only sampled together with the address, so it can stay as is.
+      uint8_t registerSet = (reg >> 8) & 1;
+      if (_lastReg == NoRegister || registerSet != ((_lastReg >> 8) & 1)) {
+        pinA1::write(registerSet);
+#if OPL3BOX_STATS
+        _stats.registerSetSwitches++;
+#endif
+      }
 
-    // Chip select. Chip select write width, Tcsw = 100ns will be ensured by the width of the write pulse.
-    pinCS::setLow();
+      // Address setup time, Tas = 10ns. (This is too short, but let's put it here just in case and for documentation.)
+      _delay_us(delayMultiple * 0.010);
 
-    // Set up the register address. (Write data setup time, Twds=10ns, will be a part of the larger write pulse width.)
-    dataIO::write(reg);
+      // Chip select. Chip select write width, Tcsw = 100ns will be ensured by the width of the write pulse.
+      pinCS::setLow();
 
-    _writePulse();
+      // Set up the register address. (Write data setup time, Twds=10ns, will be a part of the larger write pulse width.)
+      dataIO::write(reg);
+
+      _writePulse();
+
+      // Switch into the data mode, the data write below might be skipping the address phase next time.
+      pinA0::setHigh();
+
+      _lastReg = reg;
+      
+    } else {
+#if OPL3BOX_STATS
+      _stats.addressSkips++;
+#endif
+    }
 
     // Set up the register data.
     dataIO::write(data);
-
-    // Switch into the data mode.
-    pinA0::setHigh();
     
     // Address setup time, Tas = 10ns.
     _delay_us(delayMultiple * 0.010);
     
     _writePulse();
+
+    _markWritten(reg, data);
+
+#if OPL3BOX_STATS
+    _stats.writes++;
+#endif
   }
-  
+
+  /** A single register write, e.g. an entry of `WriteQueue`. */
+  struct RegisterWrite {
+    uint16_t reg;
+    uint8_t value;
+  };
+
 public:
 
   /** The clock frequency of the chip, Hz. */
   static const uint32_t F = 14318180;
 
+  /** Register 0 does not exist on the chip, so scripts use it to encode commands. */
+  static const uint8_t ScriptCommand = 0x00;
+
+  /** @{ */
+  /** Commands of the init scripts, see `writeScript()`. */
+  #define YM262_SCRIPT_SET(set) 0x00, (set)
+  #define YM262_SCRIPT_END 0x00, 0xFF
+  /** @} */
+
+  /** 
+   * Plays a compact (register, value) script stored in flash. Register values are within the current register set, 
+   * which is 0 initially and can be changed via `YM262_SCRIPT_SET()`; the script must end with `YM262_SCRIPT_END`.
+   * Zero values are skipped for the registers that are known to be zero already, e.g. right after `reset()`.
+   */
+  static void writeScript(const uint8_t *script) {
+    uint16_t set = 0;
+    for (;;) {
+      uint8_t reg = pgm_read_byte(script++);
+      uint8_t value = pgm_read_byte(script++);
+      if (reg == ScriptCommand) {
+        if (value == 0xFF)
+          break;
+        set = (uint16_t)value << 8;
+      } else {
+        writeIfNeeded(set | reg, value);
+      }
+    }
+  }
+
+  /** True, if the register might hold a non-zero value. */
+  static inline bool isDirty(uint16_t reg) {
+    return _dirty.bits[(reg >> 3) & 0x3F] & _BV(reg & 7);
+  }
+
+  /** Writes the register unless the value is zero and the register is known to be zero already. */
+  static inline void writeIfNeeded(uint16_t reg, uint8_t value) {
+    if (value || isDirty(reg))
+      write(reg, value);
+  }
+
   static void reset() {
 
     if (!pinIC::unused) {
@@ -95,24 +230,57 @@ public:
       // The chip should have its own pull-up to drive the reset signal HIGH, so we could switch to hi-Z here, 
       // but don't want to rely on it, as it seemed too weak on the scope.
       pinIC::setInput(true);
+
+      _lastReg = NoRegister;
+
+      // All the registers are zero after the hardware reset.
+      memset(_dirty.bits, 0, sizeof(_dirty.bits));
       
     } else {
 
       // IC pin is not attached, let's clean the registers one by one.
-      
-      // Wipe OPL2 regs first.
-      for (uint16_t reg = 0x01; reg <= 0xF5; reg++) {
-        write(reg, 0);
+
+      bool mapValid = (_dirty.signature == DirtySignature);
+      if (!mapValid) {
+        memset(_dirty.bits, 0, sizeof(_dirty.bits));
+        _dirty.signature = DirtySignature;
       }
 
-      // Now OPL3 ones, but need to have OPL3 mode enabled first, the regs are not writable otherwise.
+      // The regs in the set 1 are not writable unless OPL3 mode is enabled, so doing it first.
+      // (The mode is left enabled after the reset.)
       write(0x105, _BV(0));
-      // Disable 4 operator modes for now.
-      write(0x104, 0);
-      // And wipe the test reg just in case.
-      write(0x101, 0);
-      for (uint16_t reg = 0x120; reg <= 0x1F5; reg++) {
-        write(reg, 0);
+
+      if (mapValid) {
+
+        // The map has survived the reset of the MCU (e.g. when a new sketch was uploaded), 
+        // so only the registers we've touched before need wiping.
+        for (uint8_t i = 0; i < sizeof(_dirty.bits); i++) {
+          uint8_t bits = _dirty.bits[i];
+          for (uint8_t bit = 0; bits; bit++, bits >>= 1) {
+            uint16_t reg = ((uint16_t)i << 3) | bit;
+            if ((bits & 1) && reg != 0x105)
+              write(reg, 0);
+          }
+        }
+
+      } else {
+
+        // Don't know anything about the state of the chip, e.g. after a power up, 
+        // so wiping every register that exists (instead of the whole 0x01-0xF5 range) in both sets.
+        for (uint16_t set = 0; set <= 0x100; set += 0x100) {
+          _wipeOperatorAndChannelRegs(set);
+        }
+
+        // Test, timers and the rest of the global regs of the set 0.
+        for (uint8_t reg = 0x01; reg <= 0x04; reg++) {
+          write(reg, 0);
+        }
+        write(0x08, 0);
+        write(0xBD, 0);
+
+        // Test reg and 4 operator modes of the set 1.
+        write(0x101, 0);
+        write(0x104, 0);
       }
     }
   }
@@ -136,20 +304,77 @@ public:
     pinA1::setOutput();
     pinA1::setHigh();
 
+    // Don't know what was latched before.
+    _lastReg = NoRegister;
+
     reset();
 
-    // Set Waveform Select Enable bit, so Waveform Select registers work.
-    write(0x01, _BV(5));
+    static const uint8_t initScript[] PROGMEM = {
+      
+      // Set Waveform Select Enable bit, so Waveform Select registers work.
+      0x01, _BV(5),
+
+      // Set the Keyboard Split bit to 1, so Key Scale Number is determined by the block number together with the bit 9 of the f-number (instead of bit 8).
+      // The Key Scale Numbers are used with Key Scale Rate parameter.
+      0x08, _BV(6),
 
-    // Set the Keyboard Split bit to 1, so Key Scale Number is determined by the block number together with the bit 9 of the f-number (instead of bit 8).
-    // The Key Scale Numbers are used with Key Scale Rate parameter.
-    write(0x08, _BV(6));
+      YM262_SCRIPT_SET(1),
 
-    // Set OPL3 Mode Enable bit, so we are not in OPL2 compatibility mode.
-    write(0x105, _BV(0));
+      // Set OPL3 Mode Enable bit, so we are not in OPL2 compatibility mode.
+      0x05, _BV(0),
 
-    // Enable 4 operator mode for all possible 6 channels (bits 0-5).
-    //! write(0x104, 0x3F);
+      // Enable 4 operator mode for all possible 6 channels (bits 0-5).
+      //! 0x04, 0x3F,
+      
+      YM262_SCRIPT_END
+    };
+    writeScript(initScript);
+  }
+
+protected:
+
+  /** 
+   * Registers that might hold non-zero values, one bit per register. 
+   * It is kept in `.noinit` together with a signature, so it survives the reset of the MCU, while the chip keeps its state.
+   */
+  struct RegisterMap {
+    uint32_t signature;
+    uint8_t bits[0x200 / 8];
+  };
+  
+  static RegisterMap _dirty;
+
+  static const uint32_t DirtySignature = 0x4F504C33;
+
+  static inline void _markWritten(uint16_t reg, uint8_t data) {
+    uint8_t& bits = _dirty.bits[(reg >> 3) & 0x3F];
+    uint8_t mask = _BV(reg & 7);
+    if (data)
+      bits |= mask;
+    else
+      bits &= ~mask;
+  }
+
+  /** Zeroes the registers of all the operators and channels within the given register set (0 or 0x100). */
+  static void _wipeOperatorAndChannelRegs(uint16_t set) {
+
+    // 5 kinds of operator regs, each having 3 groups of 6 operators.
+    static const uint8_t operatorBases[] PROGMEM = { 0x20, 0x40, 0x60, 0x80, 0xE0 };
+    for (uint8_t i = 0; i < sizeof(operatorBases); i++) {
+      uint8_t base = pgm_read_byte(operatorBases + i);
+      for (uint8_t group = 0; group < 0x18; group += 0x08) {
+        for (uint8_t op = 0; op < 6; op++) {
+          write(set | (base + group + op), 0);
+        }
+      }
+    }
+
+    // A0, B0 and C0 for 9 channels.
+    for (uint8_t base = 0xA0; base <= 0xC0; base += 0x10) {
+      for (uint8_t ch = 0; ch < 9; ch++) {
+        write(set | (base + ch), 0);
+      }
+    }
   }
 
 protected:
@@ -189,26 +414,86 @@ public:
     return (channel < 9) ? channel : 0x100 + channel - 9;
   }
 
-  union __attribute__((packed)) ChannelSetup {
+  /** 
+   * Zero-based OPL3 operator index (0-35) for the given operator (0 or 1) of one of the 18 channels in 2 operator mode, 
+   * suitable for `offsetForOperator()`.
+   */
+  static uint8_t operatorForChannel(uint8_t channel, uint8_t op) {
+    uint8_t ch = (channel < 9) ? channel : channel - 9;
+    return (channel < 9 ? 0 : 18) + (ch / 3) * 6 + (ch % 3) + (op ? 3 : 0);
+  }
+
+  /** Values of the A0+, B0+ and C0+ registers of a channel. */
+  struct ChannelSetup {
 
     uint8_t regs[3];
-    
-    struct __attribute__((packed)) {
-      
-        // A0+ and B0+
-        uint16_t fnumber : 10;
-        uint16_t block : 3;
-        uint16_t kon : 1;
-        uint16_t unused : 2;
-
-        // C0+
-        uint8_t cnt : 1;
-        uint8_t fb : 3;
-        uint8_t cha : 1;
-        uint8_t chb : 1;
-        uint8_t chc : 1;
-        uint8_t chd : 1; 
-    };
+
+    // A0+ and B0+, the low 8 bits of the f-number are the whole A0+, see `fnumber()`.
+    typedef RegisterField<1, 0, 2> FnumberHigh;
+    typedef RegisterField<1, 2, 3> Block;
+    typedef RegisterField<1, 5, 1> KeyOn;
+
+    // C0+
+    typedef RegisterField<2, 0, 1> Cnt;
+    typedef RegisterField<2, 1, 3> Feedback;
+    typedef RegisterField<2, 4, 1> ChA;
+    typedef RegisterField<2, 5, 1> ChB;
+    typedef RegisterField<2, 6, 1> ChC;
+    typedef RegisterField<2, 7, 1> ChD;
+
+    uint16_t fnumber() const { return regs[0] | ((uint16_t)FnumberHigh::get(regs) << 8); }
+    void setFnumber(uint16_t v) { regs[0] = v; FnumberHigh::set(regs, v >> 8); }
+
+    uint8_t block() const { return Block::get(regs); }
+    void setBlock(uint8_t v) { Block::set(regs, v); }
+
+    bool kon() const { return KeyOn::get(regs); }
+    void setKon(bool v) { KeyOn::set(regs, v); }
+
+    uint8_t cnt() const { return Cnt::get(regs); }
+    void setCnt(uint8_t v) { Cnt::set(regs, v); }
+
+    uint8_t fb() const { return Feedback::get(regs); }
+    void setFb(uint8_t v) { Feedback::set(regs, v); }
+
+    bool cha() const { return ChA::get(regs); }
+    void setCha(bool v) { ChA::set(regs, v); }
+
+    bool chb() const { return ChB::get(regs); }
+    void setChb(bool v) { ChB::set(regs, v); }
+
+    bool chc() const { return ChC::get(regs); }
+    void setChc(bool v) { ChC::set(regs, v); }
+
+    bool chd() const { return ChD::get(regs); }
+    void setChd(bool v) { ChD::set(regs, v); }
+  };
+
+  /** 
+   * Makes the C0+ part of `ChannelSetup` at compile time, see `OperatorBuilder`. 
+   * The frequency and KON are per note, so are always 0 here.
+   */
+  struct ChannelBuilder {
+
+    uint8_t c0;
+
+    constexpr ChannelBuilder(uint8_t c0 = 0) : c0(c0) {}
+
+    template<typename Field, uint8_t value>
+    constexpr ChannelBuilder with() const {
+      static_assert(Field::index == 2, "Only C0+ is a part of a patch");
+      static_assert(value <= Field::max, "The value does not fit the field");
+      return ChannelBuilder(Field::put(c0, value));
+    }
+
+    template<uint8_t value> constexpr ChannelBuilder cnt() const { return with<typename ChannelSetup::Cnt, value>(); }
+    template<uint8_t value> constexpr ChannelBuilder fb() const { return with<typename ChannelSetup::Feedback, value>(); }
+    template<bool value> constexpr ChannelBuilder cha() const { return with<typename ChannelSetup::ChA, value>(); }
+    template<bool value> constexpr ChannelBuilder chb() const { return with<typename ChannelSetup::ChB, value>(); }
+    template<bool value> constexpr ChannelBuilder chc() const { return with<typename ChannelSetup::ChC, value>(); }
+    template<bool value> constexpr ChannelBuilder chd() const { return with<typename ChannelSetup::ChD, value>(); }
+
+    constexpr ChannelSetup build() const { return ChannelSetup{{ 0, 0, c0 }}; }
   };
 
   static void setChannelFrequency(ChannelSetup& ch, uint16_t freq) {
@@ -220,10 +505,23 @@ public:
       b++;
     }
     
-    ch.fnumber = f;
-    ch.block = b;
+    ch.setFnumber(f);
+    ch.setBlock(b);
   }  
 
+  /** The block and f-number for the frequency in Hz, packed like for `setChannelBlockAndFnumber()`, at compile time. */
+  static constexpr uint16_t blockAndFnumberFor(uint16_t freq, uint8_t block = 0) {
+    return (block == 7 || ((((uint32_t)freq << 20) / (F / 288)) >> block) < 0x400)
+      ? ((uint16_t)block << 10) | (((((uint32_t)freq << 20) / (F / 288)) >> block) & 0x3FF)
+      : blockAndFnumberFor(freq, block + 1);
+  }
+
+  /** Sets both the f-number and the block packed into a single value: the block in bits 10-12, the f-number in bits 0-9. */
+  static void setChannelBlockAndFnumber(ChannelSetup& ch, uint16_t value) {
+    ch.setFnumber(value & 0x3FF);
+    ch.setBlock(value >> 10);
+  }
+
   static void channelKeyOn(uint8_t index, const ChannelSetup& ch) {
     uint16_t offset = offsetForChannel(index);
     write(0xA0 + offset, ch.regs[0]);
@@ -243,47 +541,139 @@ public:
     WaveformPulseSine = 3
   };
 
-  union __attribute__((packed)) OperatorSetup {
+  /** Values of the 20+, 40+, 60+, 80+ and E0+ registers of an operator. */
+  struct OperatorSetup {
     
     uint8_t regs[5];
 
-    struct __attribute__((packed)) {
+    // 20+
+    typedef RegisterField<0, 0, 4> Mult; // freq mult
+    typedef RegisterField<0, 4, 1> KSR;  // envelope scaling
+    typedef RegisterField<0, 5, 1> EGT;  // sustain
+    typedef RegisterField<0, 6, 1> Vib;  // vibrato
+    typedef RegisterField<0, 7, 1> AM;   // tremolo
 
-      // 20+
-      uint8_t mult : 4; // freq mult
-      uint8_t ksr : 1;  // envelope scaling
-      uint8_t egt : 1;  // sustain
-      uint8_t vib : 1;  // vibrato
-      uint8_t am : 1;   // tremolo
+    // 40+
+    typedef RegisterField<1, 0, 6> TL;   // output level
+    typedef RegisterField<1, 6, 2> KSL;  // keyboard scale level
 
-      // 40+
-      uint8_t tl : 6;   // output level
-      uint8_t ksl : 2;  // keyboard scale level
+    // 60+
+    typedef RegisterField<2, 0, 4> DR;
+    typedef RegisterField<2, 4, 4> AR;
 
-      // 60+
-      uint8_t dr : 4;
-      uint8_t ar : 4;
+    // 80+
+    typedef RegisterField<3, 0, 4> RR;
+    typedef RegisterField<3, 4, 4> SL;
 
-      // 80+
-      uint8_t rr : 4;
-      uint8_t sl : 4;
+    // E0+
+    typedef RegisterField<4, 0, 3> WS;   // waveform
 
-      // E0
-      Waveform waveform; // WS
-    };
+    uint8_t mult() const { return Mult::get(regs); }
+    void setMult(uint8_t v) { Mult::set(regs, v); }
+
+    bool ksr() const { return KSR::get(regs); }
+    void setKsr(bool v) { KSR::set(regs, v); }
+
+    bool egt() const { return EGT::get(regs); }
+    void setEgt(bool v) { EGT::set(regs, v); }
+
+    bool vib() const { return Vib::get(regs); }
+    void setVib(bool v) { Vib::set(regs, v); }
+
+    bool am() const { return AM::get(regs); }
+    void setAm(bool v) { AM::set(regs, v); }
+
+    uint8_t tl() const { return TL::get(regs); }
+    void setTl(uint8_t v) { TL::set(regs, v); }
+
+    uint8_t ksl() const { return KSL::get(regs); }
+    void setKsl(uint8_t v) { KSL::set(regs, v); }
+
+    uint8_t dr() const { return DR::get(regs); }
+    void setDr(uint8_t v) { DR::set(regs, v); }
+
+    uint8_t ar() const { return AR::get(regs); }
+    void setAr(uint8_t v) { AR::set(regs, v); }
+
+    uint8_t rr() const { return RR::get(regs); }
+    void setRr(uint8_t v) { RR::set(regs, v); }
+
+    uint8_t sl() const { return SL::get(regs); }
+    void setSl(uint8_t v) { SL::set(regs, v); }
+
+    Waveform waveform() const { return (Waveform)WS::get(regs); }
+    void setWaveform(Waveform v) { WS::set(regs, v); }
+  };
+
+  /** 
+   * Makes `OperatorSetup` at compile time, so the patches defined in the source are baked into register images 
+   * (e.g. in the program memory) and cost no code to set up:
+   *
+   *   OPL3::OperatorBuilder().ar<5>().dr<5>().rr<3>().mult<1>().build()
+   *
+   * The values are template arguments, so the ones not fitting their fields fail to compile.
+   */
+  struct OperatorBuilder {
+
+    uint8_t r0, r1, r2, r3, r4;
+
+    constexpr OperatorBuilder(uint8_t r0 = 0, uint8_t r1 = 0, uint8_t r2 = 0, uint8_t r3 = 0, uint8_t r4 = 0)
+      : r0(r0), r1(r1), r2(r2), r3(r3), r4(r4) {}
+
+    template<typename Field, uint8_t value>
+    constexpr OperatorBuilder with() const {
+      static_assert(value <= Field::max, "The value does not fit the field");
+      return OperatorBuilder(
+        Field::index == 0 ? Field::put(r0, value) : r0,
+        Field::index == 1 ? Field::put(r1, value) : r1,
+        Field::index == 2 ? Field::put(r2, value) : r2,
+        Field::index == 3 ? Field::put(r3, value) : r3,
+        Field::index == 4 ? Field::put(r4, value) : r4
+      );
+    }
+
+    template<uint8_t value> constexpr OperatorBuilder mult() const { return with<typename OperatorSetup::Mult, value>(); }
+    template<bool value> constexpr OperatorBuilder ksr() const { return with<typename OperatorSetup::KSR, value>(); }
+    template<bool value> constexpr OperatorBuilder egt() const { return with<typename OperatorSetup::EGT, value>(); }
+    template<bool value> constexpr OperatorBuilder vib() const { return with<typename OperatorSetup::Vib, value>(); }
+    template<bool value> constexpr OperatorBuilder am() const { return with<typename OperatorSetup::AM, value>(); }
+    template<uint8_t value> constexpr OperatorBuilder tl() const { return with<typename OperatorSetup::TL, value>(); }
+    template<uint8_t value> constexpr OperatorBuilder ksl() const { return with<typename OperatorSetup::KSL, value>(); }
+    template<uint8_t value> constexpr OperatorBuilder ar() const { return with<typename OperatorSetup::AR, value>(); }
+    template<uint8_t value> constexpr OperatorBuilder dr() const { return with<typename OperatorSetup::DR, value>(); }
+    template<uint8_t value> constexpr OperatorBuilder sl() const { return with<typename OperatorSetup::SL, value>(); }
+    template<uint8_t value> constexpr OperatorBuilder rr() const { return with<typename OperatorSetup::RR, value>(); }
+    template<Waveform value> constexpr OperatorBuilder waveform() const { return with<typename OperatorSetup::WS, value>(); }
+
+    constexpr OperatorSetup build() const { return OperatorSetup{{ r0, r1, r2, r3, r4 }}; }
   };
 
   static void updateOperator(uint8_t index, const OperatorSetup& op) {
     uint16_t offset = offsetForOperator(index);
-    write(0x20 + offset, op.regs[0]);
-    write(0x40 + offset, op.regs[1]);
-    write(0x60 + offset, op.regs[2]);
-    write(0x80 + offset, op.regs[3]);
-    write(0xE0 + offset, op.regs[4]);
+    writeIfNeeded(0x20 + offset, op.regs[0]);
+    writeIfNeeded(0x40 + offset, op.regs[1]);
+    writeIfNeeded(0x60 + offset, op.regs[2]);
+    writeIfNeeded(0x80 + offset, op.regs[3]);
+    writeIfNeeded(0xE0 + offset, op.regs[4]);
   }
 
 public:
-  
+
+  /**
+   * Bits of the BD register. In the rhythm mode the channels 6-8 of the first register set play 5 instruments keyed
+   * on by their bits here instead of KON: the bass drum (both operators of channel 6), the hi-hat and the snare drum
+   * (the operators of channel 7), the tom-tom and the cymbal (the operators of channel 8).
+   */
+  enum Rhythm : uint8_t {
+    RhythmHiHat = 0x01,
+    RhythmCymbal = 0x02,
+    RhythmTomTom = 0x04,
+    RhythmSnareDrum = 0x08,
+    RhythmBassDrum = 0x10,
+    RhythmKeys = 0x1F,
+    RhythmMode = 0x20
+  };
+
   /** Channels in 4 op melodic + percussion mode. */
   enum Channel : uint8_t {
     ChannelFourOp0,
@@ -303,6 +693,18 @@ public:
   };
 };
 
+template<typename dataIO, typename pinIC, typename pinCS, typename pinRD, typename pinWR, typename pinA0, typename pinA1>
+uint16_t YM262<dataIO, pinIC, pinCS, pinRD, pinWR, pinA0, pinA1>::_lastReg = YM262<dataIO, pinIC, pinCS, pinRD, pinWR, pinA0, pinA1>::NoRegister;
+
+// Not initialized on purpose, see `RegisterMap`.
+template<typename dataIO, typename pinIC, typename pinCS, typename pinRD, typename pinWR, typename pinA0, typename pinA1>
+typename YM262<dataIO, pinIC, pinCS, pinRD, pinWR, pinA0, pinA1>::RegisterMap YM262<dataIO, pinIC, pinCS, pinRD, pinWR, pinA0, pinA1>::_dirty __attribute__((section(".noinit")));
+
+#if OPL3BOX_STATS
+template<typename dataIO, typename pinIC, typename pinCS, typename pinRD, typename pinWR, typename pinA0, typename pinA1>
+typename YM262<dataIO, pinIC, pinCS, pinRD, pinWR, pinA0, pinA1>::Stats YM262<dataIO, pinIC, pinCS, pinRD, pinWR, pinA0, pinA1>::_stats;
+#endif
+
 // Instantiating it as OPL3 in this project.
 typedef YM262< 
   PinBus< FastPin<14>, FastPin<10>, FastPin<9>, FastPin<8>, FastPin<7>, FastPin<6>, FastPin<5>, FastPin<4> >, // 8 pins for the data bus bits 0-7.
@@ -336,6 +738,22 @@ EC11 encoder1;
 typedef FastPin<16> encoderButton;
 
 #include "UI.h"
+#include "Voices.h"
+#include "WriteQueue.h"
+#include "Controllers.h"
+#include "Governor.h"
+#include "Scheduler.h"
+#include "MIDIClock.h"
+#include "Arpeggiator.h"
+#include "Sequencer.h"
+#include "Patterns.h"
+#include "KeyZones.h"
+#include "Layouts.h"
+#include "Tuning.h"
+#include "FinePitch.h"
+#include "MPE.h"
+#include "Patches.h"
+#include "DrumMap.h"
 
 class OPL3box : protected a21::MIDIParser<OPL3box> {
 
@@ -345,9 +763,68 @@ protected:
 
   typedef OPL3box Self;
 
-  OPL3::OperatorSetup testOperator1;
-  OPL3::OperatorSetup testOperator2;
-  OPL3::ChannelSetup testChannel;
+  /** The patch every voice plays for now, see `Patches.h`. */
+  PatchImage testPatch;
+
+  /** One voice per 2 operator channel of the chip, the voice index is the index of the channel as well. */
+  typedef Voices<18> VoiceTable;
+  VoiceTable voices;
+  // It's scanned on every note, but also takes a good share of the 2.5K of SRAM, so growing it should be a decision.
+  static_assert(sizeof(VoiceTable) <= 288, "The voice table has outgrown its SRAM budget");
+
+  /** All the writes after the boot go through here, so key events don't wait behind bulk updates. */
+  WriteQueue<OPL3, 16, 32> writes;
+
+  /** How many bulk writes can be sent per iteration of the main loop, so MIDI is served in between. */
+  static const uint8_t bulkWritesPerLoop = 8;
+
+  /** Degrades modulation when overloaded. */
+  Governor governor;
+
+  /** True, if the notes stealing voices that are still sounding should quickly fade out the previous notes first, see `WriteQueue::channelDamp()`. */
+  bool quickDamp;
+
+  /** How long to wait after the quick damp, enough to fade out from the full volume at RR 15. */
+  static const uint8_t dampMillis = 3;
+
+  /** @{ */
+  /** Future events */
+
+  enum EventKind : uint8_t {
+    /** Keying on the voice `a` using the values from the voice table, e.g. after the quick damp. */
+    EventKeyOn,
+    /** A repeat of a note: the MIDI channel and the number of the repeat in `a` (4 bits each), the note in `b`, the velocity in `c`. */
+    EventEcho,
+    /** Keying off the voice `a`, if it's still playing a repeat of the note `b`. */
+    EventEchoOff
+  };
+
+  static const uint8_t eventCapacity = 16;
+
+  /** The events are timed in milliseconds, see `serviceEvents()`. */
+  Scheduler<eventCapacity> events;
+
+  /** Handles the events that are due, called on every iteration of the main loop. */
+  void serviceEvents() {
+    Scheduler<eventCapacity>::Event e;
+    uint16_t now = millis();
+    while (events.pop(now, e)) {
+      switch (e.kind) {
+        case EventKeyOn:
+          restoreRelease(e.a);
+          keyOnVoice(e.a);
+          break;
+        case EventEcho:
+          playEcho(e.a & 0x0F, e.b, e.c, e.a >> 4);
+          break;
+        case EventEchoOff:
+          stopEcho(e.a, e.b);
+          break;
+      }
+    }
+  }
+
+  /** @} */
 
   static Self& getSelf() {
     static Self self = Self();
@@ -357,147 +834,1900 @@ protected:
   /** @{ */
   /** MIDI */
 
-  // TODO: use a table
-  static uint16_t frequencyForNote(uint8_t note) {
-    return (220.0 / 8) * pow(pow(2, 1.0 / 12), (note - 21));
-  }
+  Tunings<OPL3> tunings;
+
+  /** Splits and layers. */
+  typedef KeyZones<8, 2> KeyZonesType;
+  KeyZonesType keyZones;
 
   void handleNoteOn(uint8_t channel, uint8_t note, uint8_t velocity) {
-    
-    DebugLED::setHigh();
+    if (channel == DrumChannel && startDrum(note, velocity))
+      return;
+    if (arpeggiator.enabled && channel == arpeggiator.midiChannel)
+      arpeggiator.add(note, velocity);
+    else if (keyZones.hasZones(channel))
+      startZoneNotes(channel, note, velocity);
+    else
+      startNote(channel, note, note, velocity);
+  }
+
+  /** Starts a note for every zone of the channel covering the key and the velocity. */
+  void startZoneNotes(uint8_t channel, uint8_t key, uint8_t velocity) {
+    KeyZonesType::Zone zone;
+    for (uint8_t zones = keyZones.zonesFor(channel, key); zones; zones &= zones - 1) {
+      uint8_t index = __builtin_ctz(zones);
+      keyZones.read(index, zone);
+      if (velocity < zone.minVelocity || velocity > zone.maxVelocity)
+        continue;
+      int16_t note = (int16_t)key + zone.transpose;
+      if (note < 0 || note > 127)
+        continue;
+      startNote(channel, key, note, velocity, PatchZone + index, zone.locks, zone.lockCount);
+    }
+  }
+
+  void handleNoteOff(uint8_t channel, uint8_t note, uint8_t velocity) {
+    if (arpeggiator.enabled && channel == arpeggiator.midiChannel)
+      arpeggiator.remove(note);
+    else
+      stopNote(channel, note);
+  }
+
+  /** Values of `Voices::patch`: what is in the registers of the voice that can be changed per note. */
+  enum Patch : uint8_t {
+    PatchTest = 0,
+    /** The test patch with some parameters locked by the sequencer, different for every step, so always uploaded. */
+    PatchLocked = 1,
+    /** The test patch with the parameter locks of a key zone, the index of the zone is added to it. */
+    PatchZone = 2,
+    /** A drum of the drum kit, the index of its patch in `drumPatches` is added to it. */
+    PatchDrum = 0x80,
+    /** Something else than a patch, e.g. the rhythm instruments, see `disableRhythm()`. */
+    PatchNone = 0xFE
+  };
 
-    // Used this to test the channel mask as well.
-    //~ testChannel.regs[2]++;
+#if OPL3BOX_STATS
+  /** Notes that needed the operator registers of their patch uploaded and the ones that found them in place. */
+  uint16_t patchUploads;
+  uint16_t patchReuses;
+#endif
 
-    OPL3::setChannelFrequency(testChannel, frequencyForNote(note));
+  /** 
+   * Prepares the registers of the voice for the note of the MIDI channel in `voices.channel[v]` (with KON off), 
+   * queues the operator registers if they are different from the ones in the chip.
+   * The pitch is offset by `detune` fine steps, see `Voices::detune`. The `patch` should describe the locks.
+   */
+  void setUpVoice(uint8_t v, uint8_t channel, uint8_t note, int8_t detune, uint8_t patch, const uint8_t *locks, uint8_t lockCount, bool urgent) {
+
+    PatchImage image;
+    patchImageFor(patch, image);
+    OPL3::OperatorSetup& op0 = image.op0;
+    OPL3::OperatorSetup& op1 = image.op1;
+    OPL3::ChannelSetup& ch = voices.channel[v];
+    ch.regs[2] = image.channel.regs[2];
+    applyLocks(ch, op0, op1, locks, lockCount);
+
+    voices.feedback[v] = ch.fb();
+    // A new note has no polyphonic aftertouch yet.
+    ch.setFb(feedbackFor(ch.fb(), channel, channelPressure[channel]));
+    voices.detune[v] = detune;
+    // The drums have fixed pitches.
+    uint16_t pitch = isDrumPatch(patch) ? FinePitch::shifted(drumPitchFor(note), detune) : blockAndFnumberFor(channel, note, detune);
+    OPL3::setChannelBlockAndFnumber(ch, pitch);
+    ch.setKon(0);
+
+    VoiceTable::Mask bit = VoiceTable::maskFor(v);
+    // The release rates of a voice waiting for the quick damp are restored from the patch on its key on.
+    bool damping = events.contains(EventKeyOn, v);
+    if (damping) {
+      staleRegs[0][SustainReleaseReg] &= ~bit;
+      staleRegs[1][SustainReleaseReg] &= ~bit;
+    }
+    if (patch == PatchLocked || voices.patch[v] != patch) {
+      // The variants of the test patch differ in the lockable registers only, the drum patches in all of them.
+      bool all = isDrumPatch(patch) || isDrumPatch(voices.patch[v]);
+      for (uint8_t op = 0; op < 2; op++) {
+        const OPL3::OperatorSetup& setup = op ? op1 : op0;
+        for (uint8_t i = 0; i < OperatorRegCount; i++) {
+          if (i == LevelReg || (!all && i != LockableReg0 && i != LockableReg1) || (damping && i == SustainReleaseReg))
+            continue;
+          writeOperatorReg(v, op, baseForOperatorReg(i), setup.regs[i], urgent);
+          staleRegs[op][i] &= ~bit;
+        }
+      }
+#if OPL3BOX_STATS
+      patchUploads++;
+    } else {
+      patchReuses++;
+#endif
+    }
 
-    testChannel.kon = 1;
-    OPL3::channelKeyOn(0, testChannel);
+    // The registers that were edited while the voice was idle.
+    refreshStaleRegs(v, op0, op1, urgent);
   }
-  
-  void handleNoteOff(uint8_t channel, uint8_t note, uint8_t velocity) {
-    
-    DebugLED::setLow();
 
-    testChannel.kon = 0;
-    OPL3::channelKeyOff(0, testChannel);
+  /** Changes the registers of the test patch according to the parameter locks, see `SequencerParameter`. */
+  static void applyLocks(
+    OPL3::ChannelSetup& ch, OPL3::OperatorSetup& op0, OPL3::OperatorSetup& op1, 
+    const uint8_t *locks, uint8_t lockCount
+  ) {
+    for (uint8_t i = 0; i < lockCount; i++) {
+      uint8_t value = locks[i * 2 + 1];
+      switch (locks[i * 2]) {
+        case LockFeedback: ch.setFb(value); break;
+        case LockModulatorMult: op0.setMult(value); break;
+        case LockModulatorWaveform: op0.setWaveform((OPL3::Waveform)value); break;
+        case LockCarrierWaveform: op1.setWaveform((OPL3::Waveform)value); break;
+      }
+    }
   }
-  
-  void handlePolyAftertouch(uint8_t channel, uint8_t note, uint8_t velocity) {
+
+  /** The registers of the patch (see `Patch`) before the parameter locks. */
+  void patchImageFor(uint8_t patch, PatchImage& image) const {
+    if (isDrumPatch(patch))
+      memcpy_P(&image, &drumPatches[patch - PatchDrum], sizeof(image));
+    else
+      image = testPatch;
   }
-  
-  void handleControlChange(uint8_t channel, uint8_t control, uint8_t value) {
+
+  void writeOperatorReg(uint8_t v, uint8_t op, uint8_t base, uint8_t value, bool urgent) {
+    uint16_t reg = base + OPL3::offsetForOperator(OPL3::operatorForChannel(v, op));
+    if (urgent)
+      writes.writeUrgent(reg, value);
+    else
+      writes.writeBulk(reg, value);
   }
-  
-  void handleProgramChange(uint8_t channel, uint8_t program) {
+
+  /** @{ */
+  /** Live edits of the patch */
+
+  /** Indexes of the registers in `OPL3::OperatorSetup::regs`. */
+  enum OperatorReg : uint8_t {
+    LockableReg0 = 0,
+    LevelReg = 1,
+    AttackDecayReg = 2,
+    SustainReleaseReg = 3,
+    LockableReg1 = 4,
+    OperatorRegCount = 5
+  };
+
+  static uint8_t baseForOperatorReg(uint8_t index) {
+    return (index == LockableReg1) ? 0xE0 : 0x20 + index * 0x20;
   }
-  
-  void handleAftertouch(uint8_t channel, uint8_t value) {
+
+  /** 
+   * Voices which registers (per operator, per `OperatorReg`) do not reflect the edits of the patch yet, so have to be
+   * written on the next note on. The levels are always written on note ons, so `LevelReg` is not used.
+   */
+  VoiceTable::Mask staleRegs[2][OperatorRegCount];
+
+  /** 
+   * The operator registers and C0+ of the voice as defined by the patch it's playing. Returns false, if the locks 
+   * of the patch are not known anymore (a sequencer step that is over), then only the registers that cannot be locked
+   * are valid. Only for the variants of the test patch, the callers skip the drums.
+   */
+  bool patchOperatorsFor(uint8_t v, OPL3::OperatorSetup& op0, OPL3::OperatorSetup& op1, OPL3::ChannelSetup& ch) {
+
+    op0 = testPatch.op0;
+    op1 = testPatch.op1;
+    ch = testPatch.channel;
+
+    uint8_t patch = voices.patch[v];
+    if (patch == PatchTest)
+      return true;
+
+    // The drums and `PatchNone` come after the zones.
+    if (patch >= PatchZone && patch < PatchDrum) {
+      KeyZonesType::Zone zone;
+      keyZones.read(patch - PatchZone, zone);
+      applyLocks(ch, op0, op1, zone.locks, zone.lockCount);
+      return true;
+    }
+
+    if (v == sequencerVoice) {
+      applyLocks(ch, op0, op1, sequencer.current.locks, sequencer.current.lockCount);
+      return true;
+    }
+    if (v == sequencerPreparedVoice) {
+      applyLocks(ch, op0, op1, sequencer.next.locks, sequencer.next.lockCount);
+      return true;
+    }
+
+    return false;
   }
-  
-  void handlePitchBend(uint8_t channel, uint16_t value) {
+
+  /** 
+   * Queues the stale registers of the voice, `op0` and `op1` are what its patch defines. The lockable registers 
+   * are left stale unless `lockable` is set.
+   */
+  void refreshStaleRegs(uint8_t v, const OPL3::OperatorSetup& op0, const OPL3::OperatorSetup& op1, bool urgent, bool lockable = true) {
+    VoiceTable::Mask bit = VoiceTable::maskFor(v);
+    for (uint8_t op = 0; op < 2; op++) {
+      const OPL3::OperatorSetup& setup = op ? op1 : op0;
+      for (uint8_t i = 0; i < OperatorRegCount; i++) {
+        if (!lockable && (i == LockableReg0 || i == LockableReg1))
+          continue;
+        if (staleRegs[op][i] & bit) {
+          staleRegs[op][i] &= ~bit;
+          writeOperatorReg(v, op, baseForOperatorReg(i), setup.regs[i], urgent);
+        }
+      }
+    }
   }
-  
-  /** @} */
 
-  uint16_t prevTickMillis;
+  /** 
+   * Propagates an edit of the test patch, `prev` is the patch before the edit. Only the changed registers are written
+   * and only for the voices that are sounding (or prepared); the idle ones are marked stale and get the changes 
+   * on their next note on, see `setUpVoice()`. The feedback of the idle ones is written on every note on anyway.
+   */
+  void applyPatchEdit(const PatchImage& prev) {
+
+    // A bit per operator.
+    uint8_t levelsEdited = 0;
+    bool feedbackEdited = prev.channel.fb() != testPatch.channel.fb();
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      for (uint8_t op = 0; op < 2; op++) {
+        const OPL3::OperatorSetup& previous = op ? prev.op1 : prev.op0;
+        const OPL3::OperatorSetup& current = op ? testPatch.op1 : testPatch.op0;
+        for (uint8_t i = 0; i < OperatorRegCount; i++) {
+          if (previous.regs[i] == current.regs[i])
+            continue;
+          if (i == LevelReg)
+            levelsEdited |= _BV(op);
+          else
+            staleRegs[op][i] = VoiceTable::AllVoices;
+        }
+      }
+    }
 
-  void tick() {
+    for (uint8_t v = 0; v < 18; v++) {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+
+        // The drums do not play the test patch.
+        VoiceTable::Mask bit = VoiceTable::maskFor(v);
+        if (!((voices.held | voices.releasing | voices.reserved) & bit) || isDrumPatch(voices.patch[v]))
+          continue;
+
+        if (events.contains(EventKeyOn, v)) {
+          // Waiting for the quick damp, the release rates are restored from the patch on the key on.
+          staleRegs[0][SustainReleaseReg] &= ~bit;
+          staleRegs[1][SustainReleaseReg] &= ~bit;
+        }
+
+        // When the locks of the voice are not known, its lockable registers stay stale till its next note.
+        OPL3::OperatorSetup op0, op1;
+        OPL3::ChannelSetup ch;
+        bool known = patchOperatorsFor(v, op0, op1, ch);
+        refreshStaleRegs(v, op0, op1, false, known);
+
+        if (levelsEdited)
+          writeVoiceLevels(v, false, levelsEdited);
+
+        if (feedbackEdited && known) {
+          voices.feedback[v] = ch.fb();
+          updateFeedback(v);
+        }
+      }
+    }
   }
-  
-public:
-
-  static void begin() {
 
-    Self& self = getSelf();
+  /** @} */
 
-    DebugLED::setOutput();
-    DebugLED::setHigh();
+  /** Half of the detune between the voices of unison per MIDI channel, fine steps (see `FinePitch`), 0 if it's off. */
+  int8_t unisonDetune[16];
 
-    OPL3::begin();
+  /** 
+   * Allocates a voice for the note started by the key (see `Voices::key`) and keys it on, returns the voice. 
+   * With unison on for the channel (see `unisonDetune`) the note gets a pair of voices detuned in the opposite 
+   * directions, the first one is returned.
+   */
+  uint8_t startNote(
+    uint8_t channel, uint8_t key, uint8_t note, uint8_t velocity, 
+    uint8_t patch = PatchTest, const uint8_t *locks = nullptr, uint8_t lockCount = 0
+  ) {
     
-    Serial1.begin(31250);
+    DebugLED::setHigh();
 
-    static_cast< MIDIParser<OPL3box>& >(self).begin();
+    if (!isDrumPatch(patch))
+      scheduleEcho(channel, note, velocity, 1);
 
-    I2C::begin();
-    LCD::begin();
-    LCD::setFlippedVertically(false);
-    LCD::setContrast(10);
+    // Preferring the voices having the registers of the patch already.
+    uint8_t affinity = (patch == PatchLocked) ? VoiceTable::AnyPatch : patch;
 
-    self.page0 = true;
-    LCD::setDisplayStartLine(0);
-    LCD::clear();
-    LCD::drawTextCentered(Font8Console::data(), 0, 1, LCD::Cols, "OPL3 BOX", Font8::DrawingScale2);
-    
-    LCD::turnOn();
-    
-    self.prevTickMillis = millis();
-    
-    self.tick();
+    int8_t detune = unisonDetune[channel];
+    if (!detune) {
+      uint8_t v = voices.allocate(0, affinity);
+      setUpNote(v, channel, key, note, velocity, 0, patch, locks, lockCount);
+      keyOnNote(v);
+      return v;
+    }
 
-    // Test operators.
-    self.testChannel.cnt = 0;
-    self.testChannel.fb = 0;
-   
-    self.testChannel.cha = true;
-    self.testChannel.chb = true;
-        
-    self.testOperator1.egt = true;
-    self.testOperator1.tl = 0;
-    self.testOperator1.ar = 0x5;
-    self.testOperator1.dr = 0x5;
-    self.testOperator1.sl = 0;
-    self.testOperator1.rr = 0x3;
-    self.testOperator1.mult = 0;
-    self.testOperator1.waveform = OPL3::WaveformSine;
-
-    self.testOperator2 = self.testOperator1;
-    self.testOperator2.tl = 1;
-    self.testOperator2.mult = 1;
-
-    for (int i = 0; i < 18; i++) {
-      OPL3::updateOperator(i + 0, self.testOperator1);
-      OPL3::updateOperator(i + 3, self.testOperator2);
+    // Both voices are picked before either is taken, so the second one cannot steal the first one.
+    uint8_t a = voices.allocate(0, affinity);
+    uint8_t b = voices.allocate(VoiceTable::maskFor(a), affinity);
+    setUpNote(a, channel, key, note, velocity, -detune, patch, locks, lockCount);
+    setUpNote(b, channel, key, note, velocity, detune, patch, locks, lockCount);
+    voices.link(a, b);
+
+    // Spreading the pair: the first voice keeps the left outputs of the patch, the second one the right ones.
+    OPL3::ChannelSetup& chA = voices.channel[a];
+    if (chA.cha() || chA.chc()) {
+      chA.setChb(false);
+      chA.setChd(false);
+    }
+    OPL3::ChannelSetup& chB = voices.channel[b];
+    if (chB.chb() || chB.chd()) {
+      chB.setCha(false);
+      chB.setChc(false);
     }
 
-    DebugLED::setLow();
+    keyOnNote(a);
+    keyOnNote(b);
+    return a;
   }
 
-  uint8_t value;
-
+  /** 
+   * Takes the voice for the note and queues its registers, the channel registers are set up in the voice table only, 
+   * see `keyOnNote()`. A voice that is still sounding is keyed off first, so its note ends the way it was 
+   * instead of fading out with the registers of the new one.
+   */
+  void setUpNote(
+    uint8_t v, uint8_t channel, uint8_t key, uint8_t note, uint8_t velocity, int8_t detune, 
+    uint8_t patch, const uint8_t *locks, uint8_t lockCount
+  ) {
+
+    // The voice might still be waiting for the quick damp of its previous note to complete. It is not keyed on, so
+    // it won't be damped again below, and its release rates are restored by `setUpVoice()` instead.
+    VoiceTable::Mask bit = VoiceTable::maskFor(v);
+    if (events.cancel(EventKeyOn, v)) {
+      staleRegs[0][SustainReleaseReg] |= bit;
+      staleRegs[1][SustainReleaseReg] |= bit;
+    }
+    voices.expendable &= ~bit;
+
+    if (writes.isKeyedOn(v)) {
+      if (quickDamp && events.schedule((uint16_t)millis() + dampMillis, EventKeyOn, v)) {
+        // Fading it out quickly and keying on when it's silent, see `EventKeyOn`.
+        PatchImage image;
+        patchImageFor(voices.patch[v], image);
+        writes.channelDamp(v, voices.channel[v], image.op0, image.op1);
+      } else {
+        // No room for the event or no damping, the key on is going to wait for a bit after the key off then.
+        writes.channelKeyOffForRetrigger(v, voices.channel[v]);
+      }
+    }
+
+    setUpVoice(v, channel, note, detune, patch, locks, lockCount, true);
+    voices.channel[v].setKon(1);
+
+    voices.keyOn(v, channel, key, note, velocity, patch);
+  }
+
+  /** Keys on the voice prepared by `setUpNote()`, unless it's waiting for the quick damp of its previous note. */
+  void keyOnNote(uint8_t v) {
+    if (!events.contains(EventKeyOn, v))
+      keyOnVoice(v);
+  }
+
+  /** Queues the writes keying on the voice using the values in the voice table. */
+  void keyOnVoice(uint8_t v) {
+    // The levels should be in place before the key on.
+    writeVoiceLevels(v, true);
+    writes.channelKeyOn(v, voices.channel[v]);
+  }
+
+  /** Restores the release rates of the voice after `WriteQueue::channelDamp()`. */
+  void restoreRelease(uint8_t v) {
+    PatchImage image;
+    patchImageFor(voices.patch[v], image);
+    writes.writeUrgent(0x80 + OPL3::offsetForOperator(OPL3::operatorForChannel(v, 0)), image.op0.regs[3]);
+    writes.writeUrgent(0x80 + OPL3::offsetForOperator(OPL3::operatorForChannel(v, 1)), image.op1.regs[3]);
+  }
+  
+  /** Releases every note started by the key, there can be a few with layered zones. */
+  void stopNote(uint8_t channel, uint8_t key) {
+    uint8_t v;
+    while ((v = voices.findHeld(channel, key)) != VoiceTable::NoVoice)
+      releaseNote(v);
+  }
+
+  /** Keys the held voice off together with its unison partner, if any. */
+  void releaseNote(uint8_t v) {
+    uint8_t p = voices.partner[v];
+    releaseVoice(v);
+    if (p != VoiceTable::NoVoice && (voices.held & VoiceTable::maskFor(p)))
+      releaseVoice(p);
+  }
+
+  /** Keys the held voice off. */
+  void releaseVoice(uint8_t v) {
+
+    voices.channel[v].setKon(0);
+
+    if (events.cancel(EventKeyOn, v)) {
+      // The note was waiting for the quick damp, so it has not started yet.
+      restoreRelease(v);
+    } else {
+      writes.channelKeyOff(v, voices.channel[v]);
+    }
+
+    voices.keyOff(v, VoiceTable::releaseTicksFor(testPatch.op1.rr(), tickMillis));
+
+    if (!voices.held)
+      DebugLED::setLow();
+  }
+  
+  void handlePolyAftertouch(uint8_t channel, uint8_t note, uint8_t velocity) {
+    // Like the note offs, affects every note started by the key. Applied once per tick, see `updateLevels()`.
+    for (VoiceTable::Mask m = voices.held; m; m &= m - 1) {
+      uint8_t v = VoiceTable::firstVoice(m);
+      if (voices.key[v] == note && voices.midiChannel[v] == channel && voices.pressure[v] != velocity) {
+        voices.pressure[v] = velocity;
+        pressureVoices |= VoiceTable::maskFor(v);
+      }
+    }
+  }
+  
+  void handleControlChange(uint8_t channel, uint8_t control, uint8_t value) {
+
+    switch (control) {
+      case ControlVolume:
+      case ControlExpression:
+      case ControlBrightness:
+        // These can come at high rates, so applying only the latest values once per tick.
+        value = governor.quantize(value);
+        if (!controllers.set(channel, control, value))
+          applyControlChange(channel, control, value);
+        break;
+      case ControlArpeggiator:
+        setArpeggiator(channel, value >= 64);
+        break;
+      case ControlAftertouchTargets:
+        // A combination of `AftertouchTarget` flags.
+        aftertouchTargets[channel] = value & 0x0F;
+        pressureChanged |= _BV(channel);
+        break;
+      case ControlMorph:
+        // Any channel, as there is a single test patch. The steps towards it are taken once per tick.
+        morphTarget = governor.quantize(value);
+        break;
+      case ControlEcho:
+        echoFeedback[channel] = value;
+        break;
+      case ControlUnison:
+        // The distance between the voices is in cents, each one is detuned by half of it.
+        unisonDetune[channel] = ((uint16_t)value * FinePitch::StepsPerSemitone + 100) / 200;
+        break;
+      case ControlRPNMSB:
+        rpn[channel] = (rpn[channel] & 0x7F) | ((uint16_t)value << 7);
+        break;
+      case ControlRPNLSB:
+        rpn[channel] = (rpn[channel] & ~0x7F) | value;
+        break;
+      case ControlNRPNMSB:
+      case ControlNRPNLSB:
+        // Data entry is for NRPNs now, which we don't support.
+        rpn[channel] = RPNNull;
+        break;
+      case ControlDataEntryMSB:
+        handleRPN(channel, rpn[channel], value);
+        break;
+    }
+  }
+
+  /** The last RPN selected on every channel. */
+  uint16_t rpn[16];
+
+  enum RPN : uint16_t {
+    RPNPitchBendSensitivity = 0x0000,
+    RPNTuningProgram = 0x0003,
+    RPNMPEConfiguration = 0x0006,
+    RPNNull = 0x3FFF
+  };
+
+  void handleRPN(uint8_t channel, uint16_t parameter, uint8_t value) {
+    switch (parameter) {
+      case RPNPitchBendSensitivity:
+        bendRange[channel] = value;
+        pitchChanged |= _BV(channel);
+        break;
+      case RPNTuningProgram:
+        // The tuning is global, any channel can select it.
+        tunings.select(value);
+        break;
+      case RPNMPEConfiguration:
+        if (mpe.configure(channel, value)) {
+          // The default ranges of MPE: 2 semitones for the master channels, 48 for the member ones.
+          // The pressure of MPE notes is their loudness by default, full level till the controller reports it.
+          for (uint8_t ch = 0; ch < 16; ch++) {
+            if (mpe.isMember(ch)) {
+              bendRange[ch] = 48;
+              aftertouchTargets[ch] = TargetCarrierLevel;
+              channelPressure[ch] = 127;
+            } else if (ch == MPEZones::LowerMaster || ch == MPEZones::UpperMaster)
+              bendRange[ch] = 2;
+          }
+          pitchChanged = 0xFFFF;
+          levelsChanged = 0xFFFF;
+        }
+        break;
+    }
+  }
+
+  enum Control : uint8_t {
+    ControlVolume = 7,
+    ControlExpression = 11,
+    ControlDataEntryMSB = 6,
+    ControlBrightness = 74,
+    /** General Purpose Controller 5, turns the arpeggiator on/off for the channel. */
+    ControlArpeggiator = 80,
+    /** General Purpose Controller 6, the detune between the voices of unison in cents, 0 turns it off. */
+    ControlUnison = 81,
+    /** General Purpose Controller 7, what the aftertouch changes on the channel, see `AftertouchTarget`. */
+    ControlAftertouchTargets = 82,
+    /** General Purpose Controller 8, the level of every repeat of the echo relative to the previous one, 0 turns it off. */
+    ControlEcho = 83,
+    /** Undefined in the MIDI spec, the position of the morph of the test patch, see `morphTarget`. */
+    ControlMorph = 85,
+    ControlNRPNLSB = 98,
+    ControlNRPNMSB = 99,
+    ControlRPNLSB = 100,
+    ControlRPNMSB = 101
+  };
+
+  Controllers<8> controllers;
+
+  void applyControlChange(uint8_t channel, uint8_t control, uint8_t value) {
+
+    uint8_t *values;
+    switch (control) {
+      case ControlVolume: values = channelVolume; break;
+      case ControlExpression: values = channelExpression; break;
+      case ControlBrightness: values = channelBrightness; break;
+      default: return;
+    }
+
+    if (values[channel] != value) {
+      values[channel] = value;
+      levelsChanged |= _BV(channel);
+    }
+  }
+  
+  
+  void handleProgramChange(uint8_t channel, uint8_t program) {
+  }
+  
+  void handleAftertouch(uint8_t channel, uint8_t value) {
+    // Applied once per tick, see `updateLevels()`.
+    if (channelPressure[channel] != value) {
+      channelPressure[channel] = value;
+      pressureChanged |= _BV(channel);
+    }
+  }
+  
+  void handlePitchBend(uint8_t channel, uint16_t value) {
+    // Only the latest value matters, the voices are updated once per tick, see `updatePitches()`.
+    int16_t bend = (int16_t)value - 0x2000;
+    if (channelBend[channel] != bend) {
+      channelBend[channel] = bend;
+      pitchChanged |= _BV(channel);
+    }
+  }
+  
+  /** @} */
+
+  /** @{ */
+  /** Pitch */
+
+  MPEZones mpe;
+
+  /** Pitch bend per MIDI channel, -8192 to 8191. */
+  int16_t channelBend[16];
+
+  /** Pitch bend range per MIDI channel, semitones, see RPN 0. */
+  uint8_t bendRange[16];
+
+  /** MIDI channels where the bend or its range have changed since the last tick. */
+  uint16_t pitchChanged;
+
+  /** The pitch bend of the notes of the channel, fine steps (see `FinePitch`), including the bend of the MPE zone. */
+  int16_t bendFor(uint8_t channel) const {
+    int32_t bend = (int32_t)channelBend[channel] * bendRange[channel];
+    uint8_t master = mpe.masterFor(channel);
+    if (master != MPEZones::NoChannel)
+      bend += (int32_t)channelBend[master] * bendRange[master];
+    // The full bend is 8192 and there are 64 fine steps per semitone.
+    return bend / (0x2000 / FinePitch::StepsPerSemitone);
+  }
+
+  /** 
+   * The block and f-number for the note of the MIDI channel, taking the tuning and the pitch bend into account,
+   * offset by `detune` fine steps.
+   */
+  uint16_t blockAndFnumberFor(uint8_t channel, uint8_t note, int16_t detune) const {
+    return FinePitch::shifted(tunings.blockAndFnumber(note), bendFor(channel) + detune);
+  }
+
+  /** 
+   * Applies the bends collected since the last tick and the vibrato. Only A0+ and B0+ of the voices of the channels 
+   * that were bent or vibrating are written and only if their values change, as bulk writes, so they are coalesced 
+   * when the queue is busy.
+   */
+  void updatePitches() {
+
+    vibratoPhase += vibratoPhaseStep;
+
+    // A bend of a master channel affects the whole zone.
+    uint16_t channels = pitchChanged ? mpe.withMembers(pitchChanged) : 0;
+    pitchChanged = 0;
+
+    for (VoiceTable::Mask m = voices.held | voices.releasing; m; m &= m - 1) {
+
+      uint8_t v = VoiceTable::firstVoice(m);
+      // The drums have fixed pitches, see `setUpVoice()`.
+      if (isDrumPatch(voices.patch[v]))
+        continue;
+      VoiceTable::Mask bit = VoiceTable::maskFor(v);
+      int8_t vibrato = vibratoFor(v);
+      // The voices leaving the vibrato need one more update to get back to their pitch.
+      if (!(channels & _BV(voices.midiChannel[v])) && !vibrato && !(vibratoVoices & bit))
+        continue;
+      if (vibrato)
+        vibratoVoices |= bit;
+      else
+        vibratoVoices &= ~bit;
+
+      OPL3::ChannelSetup& ch = voices.channel[v];
+      uint8_t a0 = ch.regs[0];
+      uint8_t b0 = ch.regs[1];
+      OPL3::setChannelBlockAndFnumber(ch, blockAndFnumberFor(voices.midiChannel[v], voices.note[v], voices.detune[v] + vibrato));
+
+      // The voice waiting for the quick damp is going to be keyed on with the new values anyway.
+      if (events.contains(EventKeyOn, v))
+        continue;
+
+      uint16_t offset = OPL3::offsetForChannel(v);
+      if (ch.regs[0] != a0)
+        writes.writeBulk(0xA0 + offset, ch.regs[0]);
+      if (ch.regs[1] != b0)
+        writes.writeBulk(0xB0 + offset, ch.regs[1]);
+    }
+  }
+
+  /** @} */
+
+  /** @{ */
+  /** MIDI clock and arpeggiator */
+
+  MIDIClock midiClock;
+
+  Arpeggiator<8> arpeggiator;
+
+  enum RealtimeMessage : uint8_t {
+    MIDIClockPulse = 0xF8,
+    MIDIStart = 0xFA,
+    MIDIContinue = 0xFB,
+    MIDIStop = 0xFC
+  };
+
+  /** True while receiving a SysEx message. */
+  bool inSysEx;
+
+  /** 
+   * System Real Time messages can appear anywhere, even within other messages, so they bypass the parser; 
+   * SysEx messages bypass it as well, their bytes go to the tuning tables (the only user of them now).
+   */
+  void handleMIDIByte(uint8_t b) {
+
+    if (b >= 0xF8) {
+      handleRealtime(b);
+      return;
+    }
+
+    if (b == 0xF0) {
+      inSysEx = true;
+      tunings.sysExBegin();
+      return;
+    }
+
+    if (inSysEx) {
+      if (b < 0x80) {
+        // Not touching the voices, so the clock interrupt is not held, even though EEPROM writes can take a while.
+        tunings.sysExByte(b);
+        return;
+      }
+      inSysEx = false;
+      tunings.sysExEnd();
+      if (b == 0xF7)
+        return;
+      // Any other status byte ends the message too.
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      handleByte(b);
+    }
+  }
+
+  /** The number of MIDI bytes in a USB MIDI event packet with the given Code Index Number. */
+  static uint8_t usbMIDIEventLength(uint8_t cin) {
+    static const uint8_t lengths[16] PROGMEM = { 0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1 };
+    return pgm_read_byte(lengths + (cin & 0x0F));
+  }
+
+  void handleRealtime(uint8_t b) {
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      switch (b) {
+        case MIDIClockPulse:
+          if (midiClock.pulse(micros())) {
+            // The internal clock was waiting for this pulse, e.g. the first one after Start.
+            startClockTimer();
+          }
+          break;
+        case MIDIStart:
+          arpeggiator.restart();
+          if (sequencer.playing) {
+            stopSequencerNote();
+            unprepareSequencerStep();
+            sequencer.restart();
+            prepareSequencerStep();
+          }
+          // Fall through.
+        case MIDIContinue:
+          midiClock.start();
+          break;
+        case MIDIStop:
+          midiClock.stop();
+          TIMSK3 &= ~_BV(OCIE3A);
+          stopArpeggiatorNote();
+          stopSequencer();
+          writes.drain(0);
+          break;
+      }
+    }
+  }
+
+  /** Timer 3 runs at 1/64 of the CPU clock, so it counts 4us at 16MHz, up to 262ms between ticks. */
+  static void beginClockTimer() {
+    // CTC mode, the interrupt is enabled on the first pulse of the clock.
+    TCCR3A = 0;
+    TCCR3B = _BV(WGM32) | _BV(CS31) | _BV(CS30);
+    TIMSK3 &= ~_BV(OCIE3A);
+  }
+
+  /** Ticks the internal clock right away and then every `MIDIClock::nextIntervalMicros()`. */
+  void startClockTimer() {
+    TCNT3 = 0;
+    TIMSK3 |= _BV(OCIE3A);
+    clockTick();
+  }
+
+  static uint16_t clockTimerCountsFor(uint32_t intervalMicros) {
+    uint32_t counts = intervalMicros / (64000000UL / F_CPU);
+    return counts > 0x10000 ? 0xFFFF : (counts > 0 ? counts - 1 : 0);
+  }
+
+  /**
+   * A tick of the internal clock, called from the timer interrupt (or right away when the clock was waiting for
+   * a pulse). The notes of the arpeggiator go directly to the voices and the chip, so they are on time even when
+   * the main loop is busy drawing or sending bulk writes; everything else touching the voices or the write queue
+   * runs with interrupts disabled for this reason.
+   */
+  void clockTick() {
+
+    if (midiClock.tick()) {
+      uint8_t off, on;
+      arpeggiator.pulse(off, on);
+      if (off != arpeggiator.NoNote)
+        stopNote(arpeggiator.midiChannel, off);
+      if (on != arpeggiator.NoNote)
+        startNote(arpeggiator.midiChannel, on, on, arpeggiator.velocity);
+
+      uint8_t actions = sequencer.pulse();
+      if (actions & SequencerType::ActionNoteOff)
+        stopSequencerNote();
+      if (actions & SequencerType::ActionNoteOn)
+        startSequencerNote();
+      if (actions & SequencerType::ActionPrepare)
+        prepareSequencerStep();
+
+      writes.drain(0);
+    }
+
+    OCR3A = clockTimerCountsFor(midiClock.nextIntervalMicros());
+  }
+
+  void stopArpeggiatorNote() {
+    if (arpeggiator.playing != arpeggiator.NoNote) {
+      stopNote(arpeggiator.midiChannel, arpeggiator.playing);
+      arpeggiator.playing = arpeggiator.NoNote;
+    }
+  }
+
+  void setArpeggiator(uint8_t channel, bool enabled) {
+    if (arpeggiator.enabled == enabled && arpeggiator.midiChannel == channel)
+      return;
+    stopArpeggiatorNote();
+    // The notes held on the previous channel are forgotten, their note offs are going to be ignored.
+    arpeggiator.begin();
+    arpeggiator.enabled = enabled;
+    arpeggiator.midiChannel = channel;
+    // Without a clock the notes of the channel would never be played.
+    if (enabled)
+      startInternalClock();
+    else
+      stopInternalClock();
+  }
+
+  /** Runs on the last known tempo (or the default one) unless the clock is running already. */
+  void startInternalClock() {
+    if (!midiClock.running) {
+      midiClock.startInternal();
+      startClockTimer();
+    }
+  }
+
+  /** Stops the internal clock when neither the arpeggiator nor the sequencer needs it anymore. */
+  void stopInternalClock() {
+    if (midiClock.running && !midiClock.external && !arpeggiator.enabled && !sequencer.playing) {
+      midiClock.stop();
+      TIMSK3 &= ~_BV(OCIE3A);
+    }
+  }
+
+  /** @} */
+
+  /** @{ */
+  /** Sequencer */
+
+  typedef Sequencer<4> SequencerType;
+  SequencerType sequencer;
+
+  /** The sequencer plays on the last MIDI channel, so the controllers of this channel change its levels. */
+  static const uint8_t SequencerChannel = 15;
+
+  /** The voice reserved and prepared for the next step, `NoVoice` if none. */
+  uint8_t sequencerPreparedVoice;
+
+  /** The voice playing the current step, `NoVoice` if none. */
+  uint8_t sequencerVoice;
+  uint8_t sequencerNote;
+
+  /** 
+   * Queues the registers of the next step as bulk writes into a free voice reserved for it, so only the key on is
+   * left for the moment the step starts. Voices that are sounding are not touched, so nothing is prepared 
+   * if there are no free ones, the step is played as a regular note then.
+   */
+  void prepareSequencerStep() {
+
+    const SequencerType::Step& step = sequencer.next;
+    if (!step.velocity)
+      return;
+
+    uint8_t patch = step.lockCount ? PatchLocked : PatchTest;
+    uint8_t v = voices.allocate(0, (patch == PatchLocked) ? VoiceTable::AnyPatch : patch);
+    if (!(voices.free & VoiceTable::maskFor(v)) || voices.isReserved(v))
+      return;
+
+    voices.reserve(v);
+    voices.midiChannel[v] = SequencerChannel;
+    voices.velocity[v] = step.velocity;
+    setUpVoice(v, SequencerChannel, step.note, 0, patch, step.locks, step.lockCount, false);
+    voices.patch[v] = patch;
+
+    uint16_t offset = OPL3::offsetForChannel(v);
+    writes.writeBulk(0xA0 + offset, voices.channel[v].regs[0]);
+    writes.writeBulk(0xC0 + offset, voices.channel[v].regs[2]);
+    writeVoiceLevels(v, false);
+
+    sequencerPreparedVoice = v;
+  }
+
+  void unprepareSequencerStep() {
+    if (sequencerPreparedVoice != VoiceTable::NoVoice) {
+      voices.unreserve(sequencerPreparedVoice);
+      sequencerPreparedVoice = VoiceTable::NoVoice;
+    }
+  }
+
+  void startSequencerNote() {
+
+    const SequencerType::Step& step = sequencer.current;
+    uint8_t v = sequencerPreparedVoice;
+    sequencerPreparedVoice = VoiceTable::NoVoice;
+
+    if (v != VoiceTable::NoVoice && voices.isReserved(v)) {
+      DebugLED::setHigh();
+      voices.keyOn(v, SequencerChannel, step.note, step.note, step.velocity, voices.patch[v]);
+      voices.channel[v].setKon(1);
+      writes.channelKeyOnPrepared(v, voices.channel[v]);
+      scheduleEcho(SequencerChannel, step.note, step.velocity, 1);
+    } else {
+      // Could not prepare the voice in advance or it was taken since then.
+      v = startNote(SequencerChannel, step.note, step.note, step.velocity, step.lockCount ? PatchLocked : PatchTest, step.locks, step.lockCount);
+    }
+
+    sequencerVoice = v;
+    sequencerNote = step.note;
+  }
+
+  void stopSequencerNote() {
+
+    uint8_t v = sequencerVoice;
+    if (v == VoiceTable::NoVoice)
+      return;
+    sequencerVoice = VoiceTable::NoVoice;
+
+    // Unless the voice was stolen.
+    if ((voices.held & VoiceTable::maskFor(v)) && voices.note[v] == sequencerNote && voices.midiChannel[v] == SequencerChannel)
+      releaseNote(v);
+  }
+
+  /** Starts the pattern, following the MIDI clock if it's running, or running on the last known tempo otherwise. */
+  void startSequencer() {
+    sequencer.start(demoPattern);
+    prepareSequencerStep();
+    startInternalClock();
+  }
+
+  void stopSequencer() {
+    stopSequencerNote();
+    unprepareSequencerStep();
+    sequencer.stop();
+    stopInternalClock();
+  }
+
+  /** @} */
+
+  /** @{ */
+  /** Rhythm section */
+
+  /** 
+   * General MIDI drums come on channel 10, see `DrumMap.h`. Some of them are played on the rhythm instruments of the chip.
+   * The rhythm mode takes the channels 6-8 of the first register set, so it's only on while those are sounding: 
+   * their voices are withheld from the notes till the last rhythm instrument fades out, see `updateRhythm()`.
+   * The rest are played on the regular voices with the drum patches.
+   */
+  static const uint8_t DrumChannel = 9;
+
+  /** The voices which channels play the rhythm instruments. */
+  static const VoiceTable::Mask RhythmVoices = (VoiceTable::Mask)7 << 6;
+
+  /** The pitches of the channels 6-8 when the rhythm mode starts. */
+  static const uint16_t bassDrumPitch = OPL3::blockAndFnumberFor(65);
+  static const uint16_t snareDrumPitch = OPL3::blockAndFnumberFor(260);
+  static const uint16_t tomTomPitch = OPL3::blockAndFnumberFor(130);
+
+  /** Ticks left till every rhythm instrument fades out, 0 for the silent ones; in the order of their bits in BD. */
+  uint8_t drumTicks[5];
+
+#if OPL3BOX_STATS
+  /** How many times the rhythm mode was turned on and how many notes it cut to take their voices. */
+  uint16_t rhythmEnables;
+  uint16_t rhythmSteals;
+  /** Drums cut by the ones of the same choke group. */
+  uint16_t drumChokes;
+#endif
+
+  /** The operator playing the rhythm instrument with the given index of its bit in BD. */
+  static uint8_t operatorForRhythm(uint8_t index) {
+    static const uint8_t operators[5] PROGMEM = { 13, 17, 14, 16, 15 };
+    return pgm_read_byte(operators + index);
+  }
+
+  /** The channel which pitch the rhythm instrument with the given index of its bit in BD follows. */
+  static uint8_t channelForRhythm(uint8_t index) {
+    static const uint8_t channels[5] PROGMEM = { 7, 8, 8, 7, 6 };
+    return pgm_read_byte(channels + index);
+  }
+
+  static bool isDrumPatch(uint8_t patch) {
+    return patch >= PatchDrum && patch < PatchDrum + DrumPatchCount;
+  }
+
+  /** The fixed pitch of the GM drum note, which should be in the drum kit. */
+  static uint16_t drumPitchFor(uint8_t note) {
+    return pgm_read_word(&drumMap[note - FirstDrumNote].blockAndFnumber);
+  }
+
+  /** 
+   * How many ticks it takes for the percussive envelope of the operator to fade out: the decay and the release, 
+   * no matter when the key off comes.
+   */
+  static uint8_t percussiveTicksFor(const OPL3::OperatorSetup& op) {
+    uint16_t ticks = VoiceTable::releaseTicksFor(op.dr(), tickMillis) + VoiceTable::releaseTicksFor(op.rr(), tickMillis);
+    return (ticks > 0xFF) ? 0xFF : ticks;
+  }
+
+  /** 
+   * Plays the GM drum note, false if the note is not in the drum kit. The note offs are not waited for: the envelopes
+   * are percussive, so the drum is over after its decay and release.
+   */
+  bool startDrum(uint8_t note, uint8_t velocity) {
+
+    if (note < FirstDrumNote || note >= FirstDrumNote + DrumNoteCount)
+      return false;
+    DrumNote drum;
+    memcpy_P(&drum, &drumMap[note - FirstDrumNote], sizeof(drum));
+
+    if (drum.chokeGroups)
+      chokeDrums(drum.chokeGroups);
+
+    if (drum.patch & DrumRhythm) {
+      startRhythmDrum(drum.patch & OPL3::RhythmKeys, drum.blockAndFnumber, velocity);
+      return true;
+    }
+
+    // The drum patches are never locked, so the voices that have played the same drum before are preferred.
+    uint8_t v = startNote(DrumChannel, note, note, velocity, PatchDrum + drum.patch);
+
+    // The voice is released in the voice table only, so it can be taken by other notes once the drum has faded out.
+    // Its channel is keyed off then, see `keyOffDrums()`.
+    PatchImage image;
+    memcpy_P(&image, &drumPatches[drum.patch], sizeof(image));
+    uint8_t ticks = max(percussiveTicksFor(image.op0), percussiveTicksFor(image.op1));
+    uint8_t p = voices.partner[v];
+    voices.keyOff(v, ticks);
+    if (p != VoiceTable::NoVoice)
+      voices.keyOff(p, ticks);
+
+    if (!voices.held)
+      DebugLED::setLow();
+    return true;
+  }
+
+  /** 
+   * Keys off the channels of the drums among the given voices that have just faded out. Otherwise their next notes 
+   * would get a quick damp for nothing, see `keyOnNote()`.
+   */
+  void keyOffDrums(VoiceTable::Mask m) {
+    for (; m; m &= m - 1) {
+      uint8_t v = VoiceTable::firstVoice(m);
+      if (!isDrumPatch(voices.patch[v]) || !writes.isKeyedOn(v))
+        continue;
+      voices.channel[v].setKon(0);
+      writes.channelKeyOff(v, voices.channel[v]);
+    }
+  }
+
+  /** Cuts the drums of the choke groups that are still sounding on the regular voices. */
+  void chokeDrums(uint8_t groups) {
+
+    // The drums are released as soon as they start, see `startDrum()`.
+    for (VoiceTable::Mask m = voices.releasing; m; m &= m - 1) {
+
+      uint8_t v = VoiceTable::firstVoice(m);
+      uint8_t note = voices.key[v];
+      if (voices.midiChannel[v] != DrumChannel || !isDrumPatch(voices.patch[v]) || !writes.isKeyedOn(v))
+        continue;
+      if (!(pgm_read_byte(&drumMap[note - FirstDrumNote].chokeGroups) & groups))
+        continue;
+
+      // The release rates are restored on the next note of the voice, see `setUpVoice()`.
+      VoiceTable::Mask bit = VoiceTable::maskFor(v);
+      staleRegs[0][SustainReleaseReg] |= bit;
+      staleRegs[1][SustainReleaseReg] |= bit;
+      PatchImage image;
+      patchImageFor(voices.patch[v], image);
+      voices.channel[v].setKon(0);
+      writes.channelDamp(v, voices.channel[v], image.op0, image.op1);
+      voices.keyOff(v, 1);
+#if OPL3BOX_STATS
+      drumChokes++;
+#endif
+    }
+  }
+
+  /** Plays the rhythm instrument (its bit in BD), turning the rhythm mode on if needed. */
+  void startRhythmDrum(uint8_t key, uint16_t blockAndFnumber, uint8_t velocity) {
+
+    if (!(writes.rhythm & OPL3::RhythmMode))
+      enableRhythm();
+
+    uint8_t index = __builtin_ctz(key);
+    if (blockAndFnumber)
+      setDrumPitch(channelForRhythm(index), blockAndFnumber);
+
+    OPL3::OperatorSetup op;
+    memcpy_P(&op, &rhythmPatch.instruments[index], sizeof(op));
+    uint8_t attenuation = attenuationFor(channelVolume[DrumChannel]) + attenuationFor(channelExpression[DrumChannel]) + attenuationFor(velocity);
+    op.setTl(clampTL(op.tl() + attenuation));
+    writes.writeUrgent(0x40 + OPL3::offsetForOperator(operatorForRhythm(index)), op.regs[1]);
+
+    writes.rhythmKeyOn(key);
+
+    drumTicks[index] = percussiveTicksFor(op);
+  }
+
+  /** Sets the pitch of the rhythm channel (6-8). */
+  void setDrumPitch(uint8_t channel, uint16_t blockAndFnumber) {
+    OPL3::ChannelSetup& ch = voices.channel[channel];
+    OPL3::setChannelBlockAndFnumber(ch, blockAndFnumber);
+    uint16_t offset = OPL3::offsetForChannel(channel);
+    writes.writeUrgent(0xA0 + offset, ch.regs[0]);
+    writes.writeUrgent(0xB0 + offset, ch.regs[1]);
+  }
+
+  /** Takes the voices of the channels 6-8 cutting their notes, uploads the rhythm instruments and turns the rhythm mode on. */
+  void enableRhythm() {
+
+    voices.withheld |= RhythmVoices;
+
+    for (VoiceTable::Mask m = (voices.held | voices.releasing | voices.reserved) & RhythmVoices; m; m &= m - 1) {
+      uint8_t v = VoiceTable::firstVoice(m);
+      // The quick damp of the voice is of no use anymore, the release rates are replaced below anyway.
+      events.cancel(EventKeyOn, v);
+      if (v == sequencerPreparedVoice)
+        sequencerPreparedVoice = VoiceTable::NoVoice;
+      voices.stop(v);
+#if OPL3BOX_STATS
+      rhythmSteals++;
+#endif
+    }
+
+    // The urgent writes drop the bulk ones still waiting for these registers, e.g. the ones of a prepared sequencer step.
+    RhythmImage image;
+    memcpy_P(&image, &rhythmPatch, sizeof(image));
+    for (uint8_t i = 0; i < 6; i++) {
+      const OPL3::OperatorSetup& op = (i < 5) ? image.instruments[i] : image.bassDrumModulator;
+      uint16_t offset = OPL3::offsetForOperator((i < 5) ? operatorForRhythm(i) : OPL3::operatorForChannel(6, 0));
+      for (uint8_t r = 0; r < OperatorRegCount; r++)
+        writes.writeUrgent(baseForOperatorReg(r) + offset, op.regs[r]);
+    }
+
+    for (uint8_t i = 0; i < 3; i++) {
+      voices.channel[6 + i] = image.channels[i];
+      writes.writeUrgent(0xC0 + OPL3::offsetForChannel(6 + i), image.channels[i].regs[2]);
+    }
+    // KON of the channels should be off in the rhythm mode, which these take care of as well.
+    setDrumPitch(6, bassDrumPitch);
+    setDrumPitch(7, snareDrumPitch);
+    setDrumPitch(8, tomTomPitch);
+
+    writes.updateRhythm(writes.rhythm | OPL3::RhythmMode);
+#if OPL3BOX_STATS
+    rhythmEnables++;
+#endif
+  }
+
+  /** Turns the rhythm mode off and gives the voices back to the notes. */
+  void disableRhythm() {
+
+    writes.updateRhythm(writes.rhythm & ~(OPL3::RhythmMode | OPL3::RhythmKeys));
+
+    // The operators hold the rhythm instruments now, so everything but the levels has to be written on the next note on.
+    for (uint8_t op = 0; op < 2; op++) {
+      for (uint8_t i = 0; i < OperatorRegCount; i++) {
+        if (i != LevelReg)
+          staleRegs[op][i] |= RhythmVoices;
+      }
+    }
+    for (VoiceTable::Mask m = RhythmVoices; m; m &= m - 1)
+      voices.patch[VoiceTable::firstVoice(m)] = PatchNone;
+
+    voices.withheld &= ~RhythmVoices;
+  }
+
+  /** Called every tick, keys off the rhythm instruments that have faded out and turns the mode off after the last one. */
+  void updateRhythm() {
+
+    if (!(writes.rhythm & OPL3::RhythmMode))
+      return;
+
+    bool sounding = false;
+    for (uint8_t i = 0; i < 5; i++) {
+      if (!drumTicks[i])
+        continue;
+      if (--drumTicks[i])
+        sounding = true;
+      else
+        writes.rhythmKeyOff(_BV(i));
+    }
+
+    if (!sounding)
+      disableRhythm();
+  }
+
+  /** @} */
+
+  /** @{ */
+  /** Morph */
+
+  /** 
+   * The morph controller moves the test patch between the way it was when the morph left 0 (`morphSource`) and 
+   * `morphPatch`, interpolating the levels, the envelopes and the feedback; the rest comes from the source. 
+   * The position follows the controller by a limited step per tick and every step is applied as an edit 
+   * of the test patch, so only the registers where an interpolated value has moved to another integer are written,
+   * see `applyPatchEdit()`. Edits made on the device while the morph is away from 0 go into the source, 
+   * see `keepEditInMorph()`.
+   */
+
+  /** Where the morph is, 0-127, and where the controller wants it to be. */
+  uint8_t morphPosition;
+  uint8_t morphTarget;
+
+  /** The most the position moves per tick, so a sweep takes a few ticks instead of one jump. */
+  static const uint8_t morphStep = 8;
+
+  PatchImage morphSource;
+
+#if OPL3BOX_STATS
+  /** Ticks the morph moved on and the ones of them that changed any register. */
+  uint16_t morphSteps;
+  uint16_t morphEdits;
+#endif
+
+  /** The value between `a` (position 0) and `b` (position 127), rounded to the nearest integer. */
+  static uint8_t morphed(uint8_t a, uint8_t b, uint8_t position) {
+    return ((uint16_t)a * (127 - position) + (uint16_t)b * position + 63) / 127;
+  }
+
+  static void morphOperator(OPL3::OperatorSetup& op, const OPL3::OperatorSetup& a, const OPL3::OperatorSetup& b, uint8_t position) {
+    op.setTl(morphed(a.tl(), b.tl(), position));
+    op.setAr(morphed(a.ar(), b.ar(), position));
+    op.setDr(morphed(a.dr(), b.dr(), position));
+    op.setSl(morphed(a.sl(), b.sl(), position));
+    op.setRr(morphed(a.rr(), b.rr(), position));
+  }
+
+  /** 
+   * The inverse of `morphed()`: the value at position 0 giving `value` at the given position (below 127), 
+   * the closest one within 0-`max`.
+   */
+  static uint8_t unmorphed(uint8_t value, uint8_t b, uint8_t position, uint8_t max) {
+    uint8_t weight = 127 - position;
+    int16_t a = ((int16_t)value * 127 - (int16_t)b * position + weight / 2) / weight;
+    return a < 0 ? 0 : (a > max ? max : a);
+  }
+
+  /** The source operator for the edited one, the values that were not edited are kept. */
+  static void unmorphOperator(
+    OPL3::OperatorSetup& op, const OPL3::OperatorSetup& source, const OPL3::OperatorSetup& prev, 
+    const OPL3::OperatorSetup& b, uint8_t position
+  ) {
+    op.setTl(op.tl() == prev.tl() ? source.tl() : unmorphed(op.tl(), b.tl(), position, 63));
+    op.setAr(op.ar() == prev.ar() ? source.ar() : unmorphed(op.ar(), b.ar(), position, 15));
+    op.setDr(op.dr() == prev.dr() ? source.dr() : unmorphed(op.dr(), b.dr(), position, 15));
+    op.setSl(op.sl() == prev.sl() ? source.sl() : unmorphed(op.sl(), b.sl(), position, 15));
+    op.setRr(op.rr() == prev.rr() ? source.rr() : unmorphed(op.rr(), b.rr(), position, 15));
+  }
+
+  /** 
+   * Carries an edit of the test patch (`prev` is the patch before it) over to the source of the morph, so the next 
+   * steps keep it: the values that are not interpolated are copied, the interpolated ones are solved for.
+   * At the very end of the morph the source has no effect, so it takes the edited values as they are.
+   */
+  void keepEditInMorph(const PatchImage& prev) {
+
+    if (morphPosition == 0)
+      return;
+
+    PatchImage source = testPatch;
+    if (morphPosition < 127) {
+      PatchImage target;
+      memcpy_P(&target, &morphPatch, sizeof(target));
+      unmorphOperator(source.op0, morphSource.op0, prev.op0, target.op0, morphPosition);
+      unmorphOperator(source.op1, morphSource.op1, prev.op1, target.op1, morphPosition);
+      uint8_t fb = source.channel.fb();
+      source.channel.setFb(fb == prev.channel.fb() ? morphSource.channel.fb() : unmorphed(fb, target.channel.fb(), morphPosition, 7));
+    }
+    morphSource = source;
+  }
+
+  /** Called every tick, moves the morph a step towards the controller. */
+  void updateMorph() {
+
+    if (morphPosition == morphTarget)
+      return;
+
+    if (morphPosition == 0)
+      morphSource = testPatch;
+
+    if (morphTarget > morphPosition)
+      morphPosition = (morphTarget - morphPosition > morphStep) ? morphPosition + morphStep : morphTarget;
+    else
+      morphPosition = (morphPosition - morphTarget > morphStep) ? morphPosition - morphStep : morphTarget;
+
+    PatchImage target;
+    memcpy_P(&target, &morphPatch, sizeof(target));
+
+    PatchImage prev = testPatch;
+    testPatch = morphSource;
+    morphOperator(testPatch.op0, morphSource.op0, target.op0, morphPosition);
+    morphOperator(testPatch.op1, morphSource.op1, target.op1, morphPosition);
+    testPatch.channel.setFb(morphed(morphSource.channel.fb(), target.channel.fb(), morphPosition));
+
+#if OPL3BOX_STATS
+    morphSteps++;
+    if (memcmp(&prev, &testPatch, sizeof(prev)))
+      morphEdits++;
+#endif
+    applyPatchEdit(prev);
+  }
+
+  /** @} */
+
+  /** @{ */
+  /** Echo */
+
+  /** 
+   * With the echo on for a MIDI channel (see `echoFeedback`) every note repeats a few times a dotted eighth apart, 
+   * following the tempo of the MIDI clock. Every repeat is quieter than the previous one (has a lower velocity, 
+   * so a higher TL of the carriers) and schedules the next one, see `EventEcho`. 
+   *
+   * The repeats only take idle voices and are skipped when only a few of those are left (or when the events are 
+   * running out), so they never take voices from the notes being played. They play the plain test patch.
+   */
+
+  /** The velocity of every repeat relative to the previous one, x/128 per MIDI channel, 0 if the echo is off. */
+  uint8_t echoFeedback[16];
+
+  /** The delay between the repeats, MIDI clock pulses. */
+  static const uint8_t echoPulses = 18;
+
+  static const uint8_t maxEchoRepeats = 3;
+
+  /** The repeats quieter than this are not played. */
+  static const uint8_t minEchoVelocity = 8;
+
+  /** The repeats are skipped when there are fewer idle voices than this. */
+  static const uint8_t minIdleVoicesForEcho = 4;
+
+  /** The events left for the quick damps, see `keyOnNote()`. */
+  static const uint8_t eventsReservedFromEcho = 4;
+
+  /** The repeats have no keys, so the note offs never find them, see `Voices::findHeld()`. */
+  static const uint8_t EchoKey = 0xFF;
+
+#if OPL3BOX_STATS
+  /** The repeats played and the ones skipped because of the lack of voices or events. */
+  uint16_t echoes;
+  uint16_t echoesSuppressed;
+#endif
+
+  uint16_t echoMillis() const {
+    return (uint32_t)midiClock.pulseInterval() * echoPulses / 1000;
+  }
+
+  /** Schedules the repeat with the given number (from 1) of the note with the given velocity, if the echo is on. */
+  void scheduleEcho(uint8_t channel, uint8_t note, uint8_t velocity, uint8_t repeat) {
+
+    if (!echoFeedback[channel] || repeat > maxEchoRepeats)
+      return;
+
+    velocity = ((uint16_t)velocity * echoFeedback[channel]) >> 7;
+    if (velocity < minEchoVelocity)
+      return;
+
+    if (events.count >= eventCapacity - eventsReservedFromEcho) {
+#if OPL3BOX_STATS
+      echoesSuppressed++;
+#endif
+      return;
+    }
+
+    events.schedule((uint16_t)millis() + echoMillis(), EventEcho, channel | (repeat << 4), note, velocity);
+  }
+
+  /** Plays the repeat of the note on an idle voice, if there are enough of them, and schedules the next one. */
+  void playEcho(uint8_t channel, uint8_t note, uint8_t velocity, uint8_t repeat) {
+
+    // The following repeats are skipped as well, as they would be even quieter.
+    VoiceTable::Mask idle = voices.free & ~voices.reserved & ~voices.withheld;
+    if (__builtin_popcountl(idle) < minIdleVoicesForEcho) {
+#if OPL3BOX_STATS
+      echoesSuppressed++;
+#endif
+      return;
+    }
+
+    // The key off goes first, so the quick damp cannot take its room: there is some as this event has just left the queue.
+    uint8_t v = voices.allocate(0, PatchTest);
+    if (!events.schedule((uint16_t)millis() + echoMillis() / 2, EventEchoOff, v, note))
+      return;
+
+    setUpNote(v, channel, EchoKey, note, velocity, 0, PatchTest, nullptr, 0);
+    keyOnNote(v);
+    // The notes played take the voices of the repeats before any others, see `VoiceTable::allocate()`.
+    voices.expendable |= VoiceTable::maskFor(v);
+#if OPL3BOX_STATS
+    echoes++;
+#endif
+
+    scheduleEcho(channel, note, velocity, repeat + 1);
+  }
+
+  /** Releases the voice, unless it's playing something else than the repeat of the note by now. */
+  void stopEcho(uint8_t v, uint8_t note) {
+    VoiceTable::Mask bit = VoiceTable::maskFor(v);
+    if (!(voices.expendable & voices.held & bit) || voices.note[v] != note)
+      return;
+    voices.expendable &= ~bit;
+    releaseVoice(v);
+  }
+
+  /** @} */
+
+  /** @{ */
+  /** Levels */
+
+  /** Controller values per MIDI channel. */
+  uint8_t channelVolume[16];
+  uint8_t channelExpression[16];
+  uint8_t channelBrightness[16];
+
+  /** MIDI channels where the above have changed since the last tick. */
+  uint16_t levelsChanged;
+
+  /** Attenuation in TL steps (0.75dB) for volume/expression values, 40 log(value / 127) dB, like in General MIDI. */
+  static uint8_t attenuationFor(uint8_t value) {
+    static const uint8_t attenuation[128] PROGMEM = {
+      63, 63, 63, 63, 63, 63, 63, 63, 63, 61, 59, 57, 55, 53, 51, 49,
+      48, 47, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, 33,
+      32, 31, 31, 30, 29, 29, 28, 27, 27, 26, 26, 25, 25, 24, 24, 23,
+      23, 22, 22, 21, 21, 20, 20, 19, 19, 19, 18, 18, 17, 17, 17, 16,
+      16, 16, 15, 15, 14, 14, 14, 13, 13, 13, 13, 12, 12, 12, 11, 11,
+      11, 10, 10, 10, 10,  9,  9,  9,  8,  8,  8,  8,  7,  7,  7,  7,
+       6,  6,  6,  6,  6,  5,  5,  5,  5,  4,  4,  4,  4,  4,  3,  3,
+       3,  3,  3,  2,  2,  2,  2,  2,  1,  1,  1,  1,  1,  0,  0,  0
+    };
+    return pgm_read_byte(attenuation + value);
+  }
+
+  static uint8_t clampTL(int16_t tl) {
+    return (tl < 0) ? 0 : (tl > OPL3::OperatorSetup::TL::max) ? OPL3::OperatorSetup::TL::max : tl;
+  }
+
+  /** 
+   * Queues the values of the TL/KSL registers of the voice's operators, taking the velocity of the note and the volume,
+   * expression and brightness of its MIDI channel into account. Urgent writes are for the voices about to be keyed on.
+   * Only the operators in `operators` (a bit per operator) are written.
+   */
+  void writeVoiceLevels(uint8_t v, bool urgent, uint8_t operators = BothOperators) {
+
+    uint8_t channel = voices.midiChannel[v];
+    uint8_t attenuation = attenuationFor(channelVolume[channel]) + attenuationFor(channelExpression[channel]) + attenuationFor(voices.velocity[v]);
+    uint8_t targets = aftertouchTargets[channel];
+    if (targets & TargetCarrierLevel)
+      attenuation += ((uint16_t)(127 - pressureFor(v)) * carrierPressureDepth) >> 7;
+    // A pair of detuned voices is about 3dB louder than one.
+    if (voices.partner[v] != VoiceTable::NoVoice)
+      attenuation += 4;
+
+    // Brightness is the level of the modulator, the center value of the controller corresponds to the patch.
+    int8_t brightness = ((int8_t)channelBrightness[channel] - 64) >> 2;
+    if (targets & TargetModulatorLevel)
+      brightness += (pressureFor(v) * modulatorPressureDepth) >> 7;
+
+    PatchImage image;
+    patchImageFor(voices.patch[v], image);
+    const OPL3::OperatorSetup& op0 = image.op0;
+    const OPL3::OperatorSetup& op1 = image.op1;
+
+    // In additive mode both operators are heard directly.
+    bool additive = voices.channel[v].cnt();
+    uint8_t tl0 = additive ? clampTL(op0.tl() + attenuation) : clampTL(op0.tl() - brightness);
+    uint8_t tl1 = clampTL(op1.tl() + attenuation);
+
+    if (operators & _BV(0))
+      writeOperatorReg(v, 0, 0x40, (op0.regs[1] & ~OPL3::OperatorSetup::TL::mask) | tl0, urgent);
+    if (operators & _BV(1))
+      writeOperatorReg(v, 1, 0x40, (op1.regs[1] & ~OPL3::OperatorSetup::TL::mask) | tl1, urgent);
+  }
+
+  static const uint8_t BothOperators = _BV(0) | _BV(1);
+
+  /** The operators of the voice that are heard directly, see `writeVoiceLevels()`. */
+  uint8_t carriersOf(uint8_t v) const {
+    return voices.channel[v].cnt() ? BothOperators : _BV(1);
+  }
+
+  /** 
+   * Applies the changes of the controllers and the aftertouch collected since the last tick. Every register 
+   * of a voice is queued once at most, no matter how many messages have come.
+   */
+  void updateLevels() {
+
+    uint8_t channel, control, value;
+    while (controllers.next(channel, control, value)) {
+      applyControlChange(channel, control, value);
+    }
+
+    if (!levelsChanged && !pressureChanged && !pressureVoices)
+      return;
+
+    for (VoiceTable::Mask m = voices.held | voices.releasing; m; m &= m - 1) {
+
+      uint8_t v = VoiceTable::firstVoice(m);
+      uint16_t bit = _BV(voices.midiChannel[v]);
+      uint8_t targets = aftertouchTargets[voices.midiChannel[v]];
+      bool pressed = (pressureChanged & bit) || (pressureVoices & VoiceTable::maskFor(v));
+
+      if (levelsChanged & bit)
+        writeVoiceLevels(v, false);
+      else if (pressed && (targets & TargetLevels))
+        writeVoiceLevels(v, false, (targets & TargetModulatorLevel) ? BothOperators : carriersOf(v));
+
+      if (pressed && (targets & TargetFeedback))
+        updateFeedback(v);
+
+      // The vibrato follows the pressure in `updatePitches()`.
+    }
+
+    levelsChanged = 0;
+    pressureChanged = 0;
+    pressureVoices = 0;
+  }
+
+  /** @} */
+
+  /** @{ */
+  /** Aftertouch */
+
+  /** What the aftertouch changes, a combination per MIDI channel can be set via `ControlAftertouchTargets`. */
+  enum AftertouchTarget : uint8_t {
+    /** The depth of the vibrato, up to `vibratoDepth`. */
+    TargetVibrato = 1,
+    /** The level of the carriers: no pressure is `carrierPressureDepth` TL steps quieter than the full one. */
+    TargetCarrierLevel = 2,
+    /** The level of the modulator, up to `modulatorPressureDepth` TL steps louder (brighter) at the full pressure. */
+    TargetModulatorLevel = 4,
+    /** The feedback, up to the maximum at the full pressure. */
+    TargetFeedback = 8,
+    TargetLevels = TargetCarrierLevel | TargetModulatorLevel
+  };
+
+  static const uint8_t carrierPressureDepth = 8;
+  static const uint8_t modulatorPressureDepth = 16;
+
+  uint8_t aftertouchTargets[16];
+
+  uint8_t channelPressure[16];
+
+  /** MIDI channels where the channel pressure has changed since the last tick. */
+  uint16_t pressureChanged;
+
+  /** Voices where the polyphonic aftertouch has changed since the last tick. */
+  VoiceTable::Mask pressureVoices;
+
+  /** The pressure on the note of the voice, whichever of the channel and polyphonic aftertouch is higher. */
+  uint8_t pressureFor(uint8_t v) const {
+    uint8_t channel = channelPressure[voices.midiChannel[v]];
+    return (voices.pressure[v] > channel) ? voices.pressure[v] : channel;
+  }
+
+  /** The feedback of the patch with the pressure applied, if it's a target on the channel. */
+  uint8_t feedbackFor(uint8_t fb, uint8_t channel, uint8_t pressure) const {
+    if (aftertouchTargets[channel] & TargetFeedback) {
+      fb += (pressure * 8) >> 7;
+      if (fb > 7)
+        fb = 7;
+    }
+    return fb;
+  }
+
+  /** Queues C0+ of the voice if the aftertouch has changed its feedback. */
+  void updateFeedback(uint8_t v) {
+    OPL3::ChannelSetup& ch = voices.channel[v];
+    uint8_t fb = feedbackFor(voices.feedback[v], voices.midiChannel[v], pressureFor(v));
+    if (ch.fb() == fb)
+      return;
+    ch.setFb(fb);
+    // The voice waiting for the quick damp is going to be keyed on with the new value anyway.
+    if (!events.contains(EventKeyOn, v))
+      writes.writeBulk(0xC0 + OPL3::offsetForChannel(v), ch.regs[2]);
+  }
+
+  /** @} */
+
+  /** @{ */
+  /** Vibrato */
+
+  /** The depth of the vibrato at the full pressure, fine steps (see `FinePitch`) each way, about 40 cents. */
+  static const uint8_t vibratoDepth = 24;
+
+  /** How much the phase of the vibrato advances every tick, about 5.5Hz. */
+  static const uint8_t vibratoPhaseStep = 28;
+
+  uint8_t vibratoPhase;
+
+  /** Voices that are currently off their pitch because of the vibrato. */
+  VoiceTable::Mask vibratoVoices;
+
+  /** The offset of the pitch of the voice due to the vibrato at the moment, fine steps. */
+  int8_t vibratoFor(uint8_t v) const {
+    if (!(aftertouchTargets[voices.midiChannel[v]] & TargetVibrato))
+      return 0;
+    uint8_t depth = (pressureFor(v) * vibratoDepth) >> 7;
+    if (!depth)
+      return 0;
+    // A triangle, -64 to 63.
+    int8_t wave = ((vibratoPhase < 128) ? vibratoPhase : 255 - vibratoPhase) - 64;
+    return ((int16_t)wave * depth) >> 6;
+  }
+
+  /** @} */
+
+  uint16_t prevTickMillis;
+
+  static const uint8_t tickMillis = 20;
+
+  void tick() {
+
+    VoiceTable::Mask releasing = voices.releasing;
+    voices.tick();
+    keyOffDrums(releasing & voices.free);
+
+    updateRhythm();
+
+    governor.tick(writes.bulkDepth(), writes.BulkCapacity);
+
+    // Modulation is the first thing to slow down when the chip cannot keep up.
+    if (governor.modulationTick()) {
+      updateMorph();
+      updateLevels();
+      updatePitches();
+    }
+  }
+
+  /** Time from entering `setup()` till the moment the chip was ready to play notes, microseconds. */
+  uint32_t bootMicros;
+
+#if OPL3BOX_STATS
+
+  uint8_t statsTicks;
+
+  /** How long the last redraw of the menu took, microseconds. */
+  uint32_t drawMicros;
+
+  /** Dumps the counters into the USB serial, one "name: value" per line. */
+  void printStats() {
+
+    Serial.print(F("boot us: ")); Serial.println(bootMicros);
+    Serial.print(F("display boot us: ")); Serial.println(displayBootMicros);
+    Serial.print(F("draw us: ")); Serial.println(drawMicros);
+
+    const OPL3::Stats& bus = OPL3::stats();
+    Serial.print(F("writes: ")); Serial.println(bus.writes);
+    Serial.print(F("set switches: ")); Serial.println(bus.registerSetSwitches);
+    Serial.print(F("address skips: ")); Serial.println(bus.addressSkips);
+
+    Serial.print(F("dropped bulk: ")); Serial.println(writes.stats.droppedBulk);
+    Serial.print(F("bulk stalls: ")); Serial.println(writes.stats.bulkStalls);
+    Serial.print(F("max bulk depth: ")); Serial.println(writes.stats.maxBulkDepth);
+    Serial.print(F("coalesced: ")); Serial.println(writes.stats.coalesced);
+    Serial.print(F("retriggers: ")); Serial.println(writes.stats.retriggers);
+    Serial.print(F("expedited: ")); Serial.println(writes.stats.expedited);
+
+    Serial.print(F("cc applied: ")); Serial.println(controllers.stats.applied);
+    Serial.print(F("cc dropped: ")); Serial.println(controllers.stats.dropped);
+    Serial.print(F("cc overflows: ")); Serial.println(controllers.stats.overflows);
+
+    Serial.print(F("max events: ")); Serial.println(events.maxCount);
+    Serial.print(F("event overflows: ")); Serial.println(events.overflows);
+
+    Serial.print(F("clock bpm: ")); Serial.println(midiClock.bpm());
+    Serial.print(F("clock max lag: ")); Serial.println(midiClock.maxLag);
+
+    Serial.print(F("patch uploads: ")); Serial.println(patchUploads);
+    Serial.print(F("patch reuses: ")); Serial.println(patchReuses);
+    uint16_t notes = patchUploads + patchReuses;
+    Serial.print(F("uploads avoided %: ")); Serial.println(notes ? (uint32_t)patchReuses * 100 / notes : 0);
+
+    Serial.print(F("rhythm enables: ")); Serial.println(rhythmEnables);
+    Serial.print(F("rhythm steals: ")); Serial.println(rhythmSteals);
+    Serial.print(F("drum chokes: ")); Serial.println(drumChokes);
+    Serial.print(F("morph steps: ")); Serial.println(morphSteps);
+    Serial.print(F("morph edits: ")); Serial.println(morphEdits);
+    Serial.print(F("echoes: ")); Serial.println(echoes);
+    Serial.print(F("echoes suppressed: ")); Serial.println(echoesSuppressed);
+
+    Serial.print(F("tuning program: ")); Serial.println(tunings.program);
+    Serial.print(F("tunings accepted: ")); Serial.println(tunings.accepted);
+    Serial.print(F("tunings rejected: ")); Serial.println(tunings.rejected);
+
+    Serial.print(F("loop us: ")); Serial.println(governor.loopMicros);
+    Serial.print(F("degradation: ")); Serial.println(governor.level);
+    Serial.print(F("max degradation: ")); Serial.println(governor.maxLevel);
+    Serial.println();
+  }
+
+#endif
+  
+public:
+
+  /** `bootStart` is the value of `micros()` on entering `setup()`, it is used to measure the boot time. */
+  static void begin(uint32_t bootStart) {
+
+    Self& self = getSelf();
+
+#if OPL3BOX_STATS
+    Serial.begin(115200);
+#endif
+
+    DebugLED::setOutput();
+    DebugLED::setHigh();
+
+    // Audio first, so we can respond to MIDI as soon as possible. The display is brought up later from `check()`.
+    OPL3::begin();
+
+    memcpy_P(&self.testPatch, &initialPatch, sizeof(self.testPatch));
+
+    // Same patch on every channel. The zero regs are known to be clean after the reset, so only about half of the regs are written.
+    for (uint8_t ch = 0; ch < 18; ch++) {
+      OPL3::updateOperator(OPL3::operatorForChannel(ch, 0), self.testPatch.op0);
+      OPL3::updateOperator(OPL3::operatorForChannel(ch, 1), self.testPatch.op1);
+    }
+    
+    self.voices.begin();
+    self.events.begin();
+    self.quickDamp = true;
+
+    self.midiClock.begin();
+    self.arpeggiator.begin();
+    self.sequencer.begin();
+    self.sequencerPreparedVoice = VoiceTable::NoVoice;
+    self.sequencerVoice = VoiceTable::NoVoice;
+    beginClockTimer();
+
+    self.controllers.begin();
+    self.tunings.begin();
+    self.mpe.begin();
+    self.keyZones.load(demoLayout);
+    self.governor.begin();
+    for (uint8_t ch = 0; ch < 16; ch++) {
+      // General MIDI defaults.
+      self.channelVolume[ch] = 100;
+      self.channelExpression[ch] = 127;
+      self.channelBrightness[ch] = 64;
+      self.rpn[ch] = RPNNull;
+      self.bendRange[ch] = 2;
+      self.aftertouchTargets[ch] = TargetVibrato;
+    }
+    
+    Serial1.begin(31250);
+
+    static_cast< MIDIParser<OPL3box>& >(self).begin();
+
+    self.prevTickMillis = millis();
+    
+    self.tick();
+
+    self.bootMicros = micros() - bootStart;
+    self.bootStart = bootStart;
+
+    self.displayInitStep = 0;
+
+    DebugLED::setLow();
+  }
+
+  /** @{ */
+  /** Display */
+
+  uint32_t bootStart;
+
+  /** Time from entering `setup()` till the display was fully initialized, microseconds. */
+  uint32_t displayBootMicros;
+
+  /** The next step of the display initialization, see `initDisplayStep()`, `DisplayReady` when done. */
+  uint8_t displayInitStep;
+
+  static const uint8_t DisplayReady = 0xFF;
+
+  /** 
+   * Performs the next short step of the display initialization. Called from the main loop, 
+   * so MIDI is served in between; the full screen clear alone would take a noticeable time over the software I2C.
+   */
+  void initDisplayStep() {
+
+    // Clearing the whole video memory (both visible and invisible halves) one page per step.
+    const uint8_t clearFirstStep = 2;
+    const uint8_t clearSteps = LCD::Pages * 2;
+
+    uint8_t step = displayInitStep++;
+
+    if (step == 0) {
+      I2C::begin();
+      LCD::begin();
+    } else if (step == 1) {
+      LCD::setFlippedVertically(false);
+      LCD::setContrast(10);
+      page0 = true;
+      LCD::setDisplayStartLine(0);
+    } else if (step < clearFirstStep + clearSteps) {
+      uint8_t page = step - clearFirstStep;
+      LCD::clear(0, page, LCD::Cols - 1, page);
+    } else if (step == clearFirstStep + clearSteps) {
+      LCD::drawTextCentered(Font8Console::data(), 0, 1, LCD::Cols, "OPL3 BOX", Font8::DrawingScale2);
+    } else {
+      LCD::turnOn();
+      displayInitStep = DisplayReady;
+      displayBootMicros = micros() - bootStart;
+    }
+  }
+
+  /** @} */
+
+  /** Called from the interrupt handler of the timer driving the internal MIDI clock. */
+  static void clockTimerInterrupt() {
+    getSelf().clockTick();
+  }
+
+  uint8_t value;
+
   bool buttonPressed;
+
+  /** When the encoder button was pressed, see `longPressMillis`. */
+  uint16_t buttonPressMillis;
+
+  /** Holding the button for this long starts/stops the sequencer instead of moving the caret. */
+  static const uint16_t longPressMillis = 800;
   
   static void check() {
 
     Self& self = getSelf();
 
+    self.governor.loop();
+
     // Calling the tick handler without a dedicated timer for now.
     uint16_t now = millis();
-    if ((uint16_t)(now - getSelf().prevTickMillis) >= 20) {
+    if ((uint16_t)(now - getSelf().prevTickMillis) >= tickMillis) {
       self.prevTickMillis = now;
-      self.tick();
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        self.tick();
+      }
+#if OPL3BOX_STATS
+      if (++self.statsTicks >= 50) {
+        self.statsTicks = 0;
+        self.printStats();
+      }
+#endif
     }
 
     // Classic MIDI on the serial port.
     if (Serial1.available()) {
-      self.handleByte(Serial1.read());
+      self.handleMIDIByte(Serial1.read());
     }
 
-    // Simplified USB MIDI for now.
+    // USB MIDI: the packets have 1 to 3 bytes of MIDI data depending on the event.
     midiEventPacket_t event = MidiUSB.read();
     if (event.header != 0) {
-      self.handleByte(event.byte1);
-      self.handleByte(event.byte2);
-      self.handleByte(event.byte3);
+      uint8_t length = usbMIDIEventLength(event.header);
+      self.handleMIDIByte(event.byte1);
+      if (length > 1)
+        self.handleMIDIByte(event.byte2);
+      if (length > 2)
+        self.handleMIDIByte(event.byte3);
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      self.serviceEvents();
+    }
+
+    // One write at a time, so the clock interrupt is not delayed by more than a single write.
+    for (uint8_t i = 0; i < bulkWritesPerLoop; i++) {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        self.writes.drain(1);
+      }
     }
 
     bool needsRedraw = false;
 
     bool buttonPressedNow = !encoderButton::read();
-    if (self.buttonPressed && !buttonPressedNow) {
-      self.onEncoderButton();
-      needsRedraw = true;
+    if (!self.buttonPressed && buttonPressedNow) {
+      self.buttonPressMillis = millis();
+    } else if (self.buttonPressed && !buttonPressedNow) {
+      if ((uint16_t)((uint16_t)millis() - self.buttonPressMillis) >= longPressMillis) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+          if (self.sequencer.playing)
+            self.stopSequencer();
+          else
+            self.startSequencer();
+        }
+      } else {
+        self.onEncoderButton();
+        needsRedraw = true;
+      }
     }
     self.buttonPressed = buttonPressedNow;
 
@@ -508,15 +2738,24 @@ public:
       needsRedraw = true;
     }
 
-    if (needsRedraw) {      
+    if (self.displayInitStep != DisplayReady) {
+      // The splash stays on the screen till the first input anyway, so no need to remember about the redraw.
+      self.initDisplayStep();
+    } else if (needsRedraw) {      
+#if OPL3BOX_STATS
+      uint32_t drawStart = micros();
+      self.draw();
+      self.drawMicros = micros() - drawStart;
+#else
       self.draw();
+#endif
     }
   }
 
   // - //
 
-  OperatorValues operator1Values = OperatorValues(testOperator1, 1);
-  OperatorValues operator2Values = OperatorValues(testOperator2, 2);
+  OperatorValues operator1Values = OperatorValues(testPatch.op0, 1);
+  OperatorValues operator2Values = OperatorValues(testPatch.op1, 2);
   
   int valuesCount() {
     return operator1Values.valuesCount + operator2Values.valuesCount;
@@ -550,28 +2789,40 @@ public:
     
     if (valueRow()) {
       
+      PatchImage prev = testPatch;
       valueAt(uiMenu)->onEncoderDelta(delta);
-
-      // Assuming something about operators has changed and updating them here for now.
-      OPL3::updateOperator(0, testOperator1);
-      OPL3::updateOperator(3, testOperator2);
+      keepEditInMorph(prev);
+      applyPatchEdit(prev);
     }
   }
 
   bool page0;
 
+  /** 
+   * The text of the menu rows in both halves of the video memory, so the rows that have not changed since the half
+   * was drawn last are not drawn again: `LCD::drawText()` with `Font8::DrawingScale2` scales every pixel, so it's slow.
+   * The characters past `menuRowChars` do not fit the screen anyway.
+   */
+  static const uint8_t menuRowChars = 24;
+  char drawnRows[2][2][menuRowChars];
+
+  void drawMenuRow(uint8_t row, const char *text) {
+
+    char *drawn = drawnRows[page0 ? 0 : 1][row];
+    if (strncmp(drawn, text, menuRowChars) == 0)
+      return;
+    strncpy(drawn, text, menuRowChars);
+
+    uint8_t page = (page0 ? 0 : 4) + row * 2;
+    LCD::clear(0, page, LCD::Cols - 1, page + 1);
+    LCD::drawText(Font8Console::data(), 0, page, text, Font8::DrawingScale2);
+  }
+
   void draw() {
 
       // Drawing in the invisible half of the video memory.
       page0 = !page0;    
 
-      uint8_t pageOffset = page0 ? 0 : 4;
-
-      LCD::clear(
-        0, pageOffset + 0, 
-        LCD::Cols - 1, pageOffset + LCD::Pages - 1
-      );
-
       OperatorValue * value = valueAt(uiMenu);
     
       char str[50];
@@ -581,14 +2832,14 @@ public:
     
       value->getParamString(str + 2, sizeof(str) - 2);
 
-      LCD::drawText(Font8Console::data(), 0, pageOffset + 0, str, Font8::DrawingScale2);
+      drawMenuRow(0, str);
       
       str[0] = valueRow() ? '>' : ' ';
       str[1] = ' ';
 
       value->getValueString(str + 2, sizeof(str) - 2);
       
-      LCD::drawText(Font8Console::data(), 0, pageOffset + 2, str, Font8::DrawingScale2);
+      drawMenuRow(1, str);
 
       // Flipping the visible and invisible parts.
       LCD::setDisplayStartLine(page0 ? 0 : 32);
@@ -597,11 +2848,19 @@ public:
 };
 
 void setup() {
+
+  // Measuring the boot time from here.
+  uint32_t bootStart = micros();
+
   encoder1PinA::setInput(true);
   encoder1PinB::setInput(true);
   encoderButton::setInput(true);
   
-  OPL3box::begin();
+  OPL3box::begin(bootStart);
+}
+
+ISR(TIMER3_COMPA_vect) {
+  OPL3box::clockTimerInterrupt();
 }
 
 void loop() {
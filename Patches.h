@@ -0,0 +1,129 @@
+/**
+ * Patches as register images in the program memory, built at compile time via `OPL3::OperatorBuilder` and
+ * `OPL3::ChannelBuilder`, so loading one is a single copy.
+ */
+
+/** The registers of a 2 operator patch: the modulator, the carrier and C0+ of the channel. */
+struct PatchImage {
+  OPL3::OperatorSetup op0;
+  OPL3::OperatorSetup op1;
+  OPL3::ChannelSetup channel;
+};
+
+/** The patch the box starts with: a plain FM tone, the carrier an octave above the modulator. */
+static const PatchImage initialPatch PROGMEM = {
+  OPL3::OperatorBuilder()
+    .egt<true>().tl<0>().ar<5>().dr<5>().sl<0>().rr<3>().mult<0>().waveform<OPL3::WaveformSine>()
+    .build(),
+  OPL3::OperatorBuilder()
+    .egt<true>().tl<1>().ar<5>().dr<5>().sl<0>().rr<3>().mult<1>().waveform<OPL3::WaveformSine>()
+    .build(),
+  OPL3::ChannelBuilder()
+    .cnt<0>().fb<0>().cha<true>().chb<true>()
+    .build()
+};
+
+/**
+ * Where the morph controller takes the test patch: a brighter pluck with more feedback. Only the levels, the envelopes
+ * and the feedback are used.
+ */
+static const PatchImage morphPatch PROGMEM = {
+  OPL3::OperatorBuilder()
+    .egt<true>().tl<12>().ar<15>().dr<7>().sl<6>().rr<6>().mult<0>().waveform<OPL3::WaveformSine>()
+    .build(),
+  OPL3::OperatorBuilder()
+    .egt<true>().tl<0>().ar<15>().dr<4>().sl<4>().rr<6>().mult<1>().waveform<OPL3::WaveformSine>()
+    .build(),
+  OPL3::ChannelBuilder()
+    .cnt<0>().fb<5>().cha<true>().chb<true>()
+    .build()
+};
+
+/**
+ * The registers of the rhythm mode, see `OPL3::Rhythm`: an operator per instrument, in the order of their bits in BD
+ * (the carrier for the bass drum), the modulator of the bass drum and C0+ of the channels 6, 7 and 8.
+ * The envelopes are percussive (no EGT), so the instruments fade out on their own even if never keyed off.
+ */
+struct RhythmImage {
+  OPL3::OperatorSetup instruments[5];
+  OPL3::OperatorSetup bassDrumModulator;
+  OPL3::ChannelSetup channels[3];
+};
+
+static const RhythmImage rhythmPatch PROGMEM = {
+  {
+    // Hi-hat.
+    OPL3::OperatorBuilder().tl<2>().ar<15>().dr<9>().sl<15>().rr<9>().mult<1>().build(),
+    // Cymbal.
+    OPL3::OperatorBuilder().tl<4>().ar<15>().dr<6>().sl<15>().rr<6>().mult<1>().build(),
+    // Tom-tom.
+    OPL3::OperatorBuilder().tl<2>().ar<15>().dr<7>().sl<15>().rr<7>().mult<1>().build(),
+    // Snare drum.
+    OPL3::OperatorBuilder().tl<0>().ar<15>().dr<8>().sl<15>().rr<8>().mult<1>().build(),
+    // Bass drum.
+    OPL3::OperatorBuilder().tl<0>().ar<15>().dr<7>().sl<15>().rr<7>().mult<1>().build()
+  },
+  OPL3::OperatorBuilder().tl<12>().ar<15>().dr<8>().sl<15>().rr<8>().mult<0>().build(),
+  {
+    OPL3::ChannelBuilder().fb<4>().cha<true>().chb<true>().build(),
+    OPL3::ChannelBuilder().cha<true>().chb<true>().build(),
+    OPL3::ChannelBuilder().cha<true>().chb<true>().build()
+  }
+};
+
+/** Patches of the drums played on the regular voices, see `DrumMap.h`. The envelopes are percussive, like above. */
+enum DrumPatch : uint8_t {
+  DrumPatchClosedHiHat,
+  DrumPatchOpenHiHat,
+  DrumPatchSkin,
+  DrumPatchWood,
+  DrumPatchMetal,
+  DrumPatchBell,
+  DrumPatchTone,
+  DrumPatchCount
+};
+
+static const PatchImage drumPatches[DrumPatchCount] PROGMEM = {
+  // Closed hi-hat, also shakers and claps: noise from the feedback and the high multipliers.
+  {
+    OPL3::OperatorBuilder().tl<8>().ar<15>().dr<10>().sl<15>().rr<10>().mult<10>().build(),
+    OPL3::OperatorBuilder().tl<2>().ar<15>().dr<9>().sl<15>().rr<9>().mult<15>().build(),
+    OPL3::ChannelBuilder().fb<7>().cha<true>().chb<true>().build()
+  },
+  // Open hi-hat.
+  {
+    OPL3::OperatorBuilder().tl<8>().ar<15>().dr<8>().sl<15>().rr<8>().mult<10>().build(),
+    OPL3::OperatorBuilder().tl<2>().ar<15>().dr<6>().sl<15>().rr<6>().mult<15>().build(),
+    OPL3::ChannelBuilder().fb<7>().cha<true>().chb<true>().build()
+  },
+  // Skin: bongos, congas, timbales.
+  {
+    OPL3::OperatorBuilder().tl<20>().ar<15>().dr<9>().sl<15>().rr<9>().mult<1>().build(),
+    OPL3::OperatorBuilder().tl<0>().ar<15>().dr<7>().sl<15>().rr<7>().mult<1>().build(),
+    OPL3::ChannelBuilder().fb<3>().cha<true>().chb<true>().build()
+  },
+  // Wood: side stick, claves, wood blocks.
+  {
+    OPL3::OperatorBuilder().tl<24>().ar<15>().dr<10>().sl<15>().rr<10>().mult<3>().build(),
+    OPL3::OperatorBuilder().tl<0>().ar<15>().dr<9>().sl<15>().rr<9>().mult<1>().build(),
+    OPL3::ChannelBuilder().cha<true>().chb<true>().build()
+  },
+  // Metal, short: cowbell, agogo, muted triangle.
+  {
+    OPL3::OperatorBuilder().tl<16>().ar<15>().dr<8>().sl<15>().rr<8>().mult<7>().build(),
+    OPL3::OperatorBuilder().tl<2>().ar<15>().dr<8>().sl<15>().rr<8>().mult<2>().build(),
+    OPL3::ChannelBuilder().fb<2>().cha<true>().chb<true>().build()
+  },
+  // Bell, ringing: open triangle, vibraslap.
+  {
+    OPL3::OperatorBuilder().tl<18>().ar<15>().dr<5>().sl<15>().rr<5>().mult<7>().build(),
+    OPL3::OperatorBuilder().tl<4>().ar<15>().dr<5>().sl<15>().rr<5>().mult<2>().build(),
+    OPL3::ChannelBuilder().fb<1>().cha<true>().chb<true>().build()
+  },
+  // Tone: whistles, cuicas, the modulator is silent.
+  {
+    OPL3::OperatorBuilder().tl<63>().ar<15>().dr<15>().sl<15>().rr<15>().mult<1>().build(),
+    OPL3::OperatorBuilder().tl<2>().ar<12>().dr<6>().sl<15>().rr<6>().mult<1>().build(),
+    OPL3::ChannelBuilder().cha<true>().chb<true>().build()
+  }
+};
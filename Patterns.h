@@ -0,0 +1,46 @@
+/**
+ * Patterns of the sequencer, see `Sequencer.h` for the format.
+ */
+
+/** What the values of the parameter locks of the sequencer steps change. */
+enum SequencerParameter : uint8_t {
+  /** Feedback of the modulator, 0-7. */
+  LockFeedback = 0,
+  /** Frequency multiplier of the modulator, 0-15. */
+  LockModulatorMult = 1,
+  /** Waveform of the modulator, 0-7. */
+  LockModulatorWaveform = 2,
+  /** Waveform of the carrier, 0-7. */
+  LockCarrierWaveform = 3
+};
+
+/** A bass line in A minor, 16th notes. */
+static const uint8_t demoPattern[] PROGMEM = {
+
+  SEQUENCER_PATTERN(16, 6),
+
+  SEQUENCER_LOCKED_STEP(45, 120, 4, 1),
+    SEQUENCER_LOCK(LockFeedback, 5),
+  SEQUENCER_STEP(45, 80, 2),
+  SEQUENCER_STEP(57, 100, 3),
+  SEQUENCER_REST(6),
+
+  SEQUENCER_STEP(45, 100, 3),
+  SEQUENCER_STEP(48, 90, 3),
+  SEQUENCER_LOCKED_STEP(52, 110, 3, 2),
+    SEQUENCER_LOCK(LockModulatorMult, 2),
+    SEQUENCER_LOCK(LockCarrierWaveform, 1),
+  SEQUENCER_STEP(45, 80, 2),
+
+  SEQUENCER_LOCKED_STEP(43, 120, 4, 1),
+    SEQUENCER_LOCK(LockFeedback, 6),
+  SEQUENCER_REST(6),
+  SEQUENCER_STEP(55, 100, 3),
+  SEQUENCER_STEP(43, 80, 2),
+
+  SEQUENCER_STEP(41, 110, 5),
+  SEQUENCER_STEP(41, 80, 2),
+  SEQUENCER_LOCKED_STEP(53, 110, 2, 1),
+    SEQUENCER_LOCK(LockModulatorWaveform, 2),
+  SEQUENCER_STEP(52, 100, 3)
+};
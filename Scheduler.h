@@ -0,0 +1,139 @@
+/**
+ * Events to be handled in the future: delayed key ons, retriggers, echoes, arpeggios, etc.
+ *
+ * A fixed capacity binary min-heap ordered by the due time, so adding or taking an event is O(log n) and the next one
+ * is always at the top. The time is a 16 bit counter in the units of the owner's choice (wrapping is fine as long as
+ * events are not scheduled more than 32767 units ahead). The meaning of the kinds and arguments of events is up to
+ * the owner as well.
+ */
+template<uint8_t capacity>
+class Scheduler {
+
+public:
+
+  struct Event {
+    uint16_t due;
+    uint8_t kind;
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+  };
+
+  /** The number of the events waiting. */
+  uint8_t count;
+
+#if OPL3BOX_STATS
+  /** Events that did not fit. */
+  uint16_t overflows;
+  /** The most events waiting at the same time. */
+  uint8_t maxCount;
+#endif
+
+  void begin() {
+    count = 0;
+  }
+
+  /** Adds an event, returns false if there is no room for it. */
+  bool schedule(uint16_t due, uint8_t kind, uint8_t a = 0, uint8_t b = 0, uint8_t c = 0) {
+
+    if (count == capacity) {
+#if OPL3BOX_STATS
+      overflows++;
+#endif
+      return false;
+    }
+
+    Event e = { due, kind, a, b, c };
+    _siftUp(count++, e);
+
+#if OPL3BOX_STATS
+    if (count > maxCount)
+      maxCount = count;
+#endif
+    return true;
+  }
+
+  /** The event that is due first, null if there are none. */
+  const Event *peek() const {
+    return count ? &_heap[0] : nullptr;
+  }
+
+  /** Takes the event that is due first if it is due already at the given time. Returns false otherwise. */
+  bool pop(uint16_t now, Event& e) {
+    if (count == 0 || _before(now, _heap[0].due))
+      return false;
+    e = _heap[0];
+    _removeAt(0);
+    return true;
+  }
+
+  /** Removes all the events of the given kind having the given first argument, returns how many were removed. */
+  uint8_t cancel(uint8_t kind, uint8_t a) {
+    uint8_t removed = 0;
+    for (uint8_t i = 0; i < count; ) {
+      if (_heap[i].kind == kind && _heap[i].a == a) {
+        // The last event moved into the hole can be sifted up to an index already checked, so starting over.
+        _removeAt(i);
+        removed++;
+        i = 0;
+      } else {
+        i++;
+      }
+    }
+    return removed;
+  }
+
+  /** True, if there is at least one event of the given kind having the given first argument. */
+  bool contains(uint8_t kind, uint8_t a) const {
+    for (uint8_t i = 0; i < count; i++) {
+      if (_heap[i].kind == kind && _heap[i].a == a)
+        return true;
+    }
+    return false;
+  }
+
+protected:
+
+  Event _heap[capacity];
+
+  static inline bool _before(uint16_t t1, uint16_t t2) {
+    return (int16_t)(t1 - t2) < 0;
+  }
+
+  void _siftUp(uint8_t i, const Event& e) {
+    while (i > 0) {
+      uint8_t parent = (i - 1) >> 1;
+      if (!_before(e.due, _heap[parent].due))
+        break;
+      _heap[i] = _heap[parent];
+      i = parent;
+    }
+    _heap[i] = e;
+  }
+
+  void _siftDown(uint8_t i, const Event& e) {
+    for (;;) {
+      uint8_t child = 2 * i + 1;
+      if (child >= count)
+        break;
+      if (child + 1 < count && _before(_heap[child + 1].due, _heap[child].due))
+        child++;
+      if (!_before(_heap[child].due, e.due))
+        break;
+      _heap[i] = _heap[child];
+      i = child;
+    }
+    _heap[i] = e;
+  }
+
+  void _removeAt(uint8_t i) {
+    Event last = _heap[--count];
+    if (i == count)
+      return;
+    // The last event can be both earlier than the parent of the hole or later than its children.
+    if (i > 0 && _before(last.due, _heap[(i - 1) >> 1].due))
+      _siftUp(i, last);
+    else
+      _siftDown(i, last);
+  }
+};
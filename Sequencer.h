@@ -0,0 +1,154 @@
+/**
+ * A pattern in the program memory starts with the number of steps and the number of clock pulses per step,
+ * see `SEQUENCER_PATTERN()`, followed by the steps.
+ *
+ * Every step is 3 bytes: the note, the velocity (0 for a rest) and the gate in clock pulses, see `SEQUENCER_STEP()`.
+ * A step can lock parameters for its note, see `SEQUENCER_LOCKED_STEP()`: then the bit 7 of the note is set and the
+ * number of locks follows the gate, then the locks themselves, 2 bytes each, see `SEQUENCER_LOCK()`.
+ */
+#define SEQUENCER_PATTERN(steps, pulsesPerStep) (steps), (pulsesPerStep)
+#define SEQUENCER_STEP(note, velocity, gate) (note), (velocity), (gate)
+#define SEQUENCER_REST(gate) 0, 0, (gate)
+#define SEQUENCER_LOCKED_STEP(note, velocity, gate, locks) (0x80 | (note)), (velocity), (gate), (locks)
+#define SEQUENCER_LOCK(parameter, value) (parameter), (value)
+
+/**
+ * Plays a pattern from the program memory on the pulses of a clock.
+ *
+ * Every step is read one pulse ahead of its time, so its registers can be prepared (queued as bulk writes into
+ * a reserved voice) and only the key on is left for the moment the step starts. What the parameters and their values
+ * mean is up to the owner.
+ */
+template<uint8_t maxLocks>
+class Sequencer {
+
+public:
+
+  struct Step {
+    uint8_t note;
+    /** 0 for a rest. */
+    uint8_t velocity;
+    /** How many pulses the note lasts, at least 1. */
+    uint8_t gate;
+    uint8_t lockCount;
+    /** Parameter and value pairs. */
+    uint8_t locks[maxLocks * 2];
+  };
+
+  /** What should be done on the current pulse, see `pulse()`. */
+  enum Action : uint8_t {
+    /** The note of the previous step should stop. */
+    ActionNoteOff = 1,
+    /** The step in `current` should start. */
+    ActionNoteOn = 2,
+    /** The next step has been read into `next` and can be prepared. */
+    ActionPrepare = 4
+  };
+
+  bool playing;
+
+  /** The step that is going to start next, valid after `start()` and `ActionPrepare`. */
+  Step next;
+
+  /** The step that has started on the last `ActionNoteOn`. */
+  Step current;
+
+  void begin() {
+    playing = false;
+    _pattern = nullptr;
+  }
+
+  /** Starts from the first step of the pattern on the next pulse. The first step is read already, so can be prepared. */
+  void start(const uint8_t *pattern) {
+    _pattern = pattern;
+    _stepCount = pgm_read_byte(pattern);
+    _pulsesPerStep = pgm_read_byte(pattern + 1);
+    restart();
+    playing = true;
+  }
+
+  /** Goes back to the first step, the note that is playing is left to the owner. */
+  void restart() {
+    _step = 0;
+    _pulse = 0;
+    _gateLeft = 0;
+    _readStep();
+  }
+
+  void stop() {
+    playing = false;
+  }
+
+  /** Advances by a pulse of the clock, returns a combination of `Action` flags in the order they should be handled. */
+  uint8_t pulse() {
+
+    if (!playing)
+      return 0;
+
+    uint8_t actions = 0;
+
+    if (_gateLeft > 0 && (--_gateLeft == 0 || _pulse == 0)) {
+      _gateLeft = 0;
+      actions |= ActionNoteOff;
+    }
+
+    if (_pulse == 0 && next.velocity) {
+      current = next;
+      _gateLeft = current.gate ? current.gate : 1;
+      actions |= ActionNoteOn;
+    }
+
+    if (++_pulse == _pulsesPerStep) {
+      _pulse = 0;
+    }
+
+    // One pulse ahead of the next step.
+    if (_pulse == 0) {
+      if (++_step == _stepCount)
+        _step = 0;
+      _readStep();
+      actions |= ActionPrepare;
+    }
+
+    return actions;
+  }
+
+protected:
+
+  const uint8_t *_pattern;
+  uint8_t _stepCount;
+  uint8_t _pulsesPerStep;
+
+  uint8_t _step;
+  uint8_t _pulse;
+  uint8_t _gateLeft;
+
+  /** Where the step after `next` starts, the steps are of different lengths. */
+  const uint8_t *_stepData;
+
+  void _readStep() {
+
+    const uint8_t *p = (_step == 0) ? _pattern + 2 : _stepData;
+
+    uint8_t note = pgm_read_byte(p++);
+    next.note = note & 0x7F;
+    next.velocity = pgm_read_byte(p++);
+    next.gate = pgm_read_byte(p++);
+    next.lockCount = 0;
+
+    if (note & 0x80) {
+      uint8_t count = pgm_read_byte(p++);
+      for (uint8_t i = 0; i < count; i++) {
+        uint8_t parameter = pgm_read_byte(p++);
+        uint8_t value = pgm_read_byte(p++);
+        if (next.lockCount < maxLocks) {
+          next.locks[next.lockCount * 2] = parameter;
+          next.locks[next.lockCount * 2 + 1] = value;
+          next.lockCount++;
+        }
+      }
+    }
+
+    _stepData = p;
+  }
+};
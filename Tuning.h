@@ -0,0 +1,285 @@
+#include "EqualTemperament.h"
+
+/**
+ * Tuning tables: a block/f-number pair for every MIDI note, packed as in the A0+/B0+ registers (the block in bits 10-12,
+ * the f-number in bits 0-9), so a note costs a single table lookup regardless of the tuning.
+ *
+ * Program 0 is the built-in 12-tone equal temperament (`EqualTemperament.h`), programs 1 to `Slots` live in EEPROM.
+ * Those are filled via MIDI Tuning Standard SysEx messages, see `tools/tuning.py` for making them from Scala files;
+ * the selected program is kept in EEPROM as well.
+ *
+ * The table of the selected program is copied into RAM, so the notes started from the clock interrupt neither touch
+ * the EEPROM (which the SysEx handler might be writing at the same time) nor wait for it.
+ *
+ * EEPROM layout: the selected program at `EEPROMBase`, then a byte per slot set to `ValidSlot` once the slot
+ * has a complete table, then the tables of the slots, 256 bytes each.
+ */
+template<typename Chip>
+class Tunings {
+
+public:
+
+  static const uint8_t Slots = 3;
+
+  static const uint16_t EEPROMBase = 0;
+
+  /** The selected tuning program. */
+  uint8_t program;
+
+#if OPL3BOX_STATS
+  /** Tuning messages that were accepted and rejected (bad checksums, programs, truncated ones, etc). */
+  uint8_t accepted;
+  uint8_t rejected;
+#endif
+
+  void begin() {
+    uint8_t p = eeprom_read_byte(_selectedAddress());
+    _load((p <= Slots && _isValid(p)) ? p : 0);
+  }
+
+  /** The block and f-number for the note in the selected tuning, see above. */
+  uint16_t blockAndFnumber(uint8_t note) const {
+    return _table[note];
+  }
+
+  /** Selects the tuning program, e.g. via RPN 3; the ones without a complete table are ignored. */
+  void select(uint8_t p) {
+    if (p > Slots || !_isValid(p))
+      return;
+    _load(p);
+    eeprom_update_byte(_selectedAddress(), p);
+  }
+
+  /**
+   * The block and f-number for the frequency given the way MIDI Tuning Standard does it: the semitone (MIDI note)
+   * below it and the 14 bit fraction of a semitone above that.
+   */
+  static uint16_t blockAndFnumberFor(uint8_t semitone, uint16_t fraction) {
+
+    float hz = 440.0 * pow(2, ((semitone - 69) + fraction / 16384.0) / 12.0);
+
+    // The same as `tools/tuning.py` does for the default table.
+    float f = hz * (1048576.0 / (Chip::F / 288.0));
+    uint8_t block = 0;
+    while (f >= 1023.5 && block < 7) {
+      f *= 0.5;
+      block++;
+    }
+    uint16_t fnumber = (f >= 1023) ? 1023 : (uint16_t)(f + 0.5);
+
+    return ((uint16_t)block << 10) | fnumber;
+  }
+
+  /** @{ */
+  /**
+   * The bytes of a SysEx message, without F0 and F7. The tables are written into EEPROM while the message is being
+   * received (a few milliseconds per note), so the bulk dumps have to come via USB which can wait for the box.
+   * Single note changes affect the next notes only, the ones sounding keep their pitch.
+   */
+
+  void sysExBegin() {
+    _state = StateHeader;
+    _index = 0;
+    _checksum = 0;
+  }
+
+  void sysExByte(uint8_t b) {
+
+    uint16_t i = _index++;
+
+    switch (_state) {
+
+      case StateHeader:
+        _checksum ^= b;
+        // Universal Non-Real Time (bulk dumps) or Real Time (single note changes), any device, MIDI Tuning Standard.
+        if ((i == 0 && b != 0x7E && b != 0x7F) || (i == 2 && b != 0x08)) {
+          _state = StateIgnore;
+        } else if (i == 0) {
+          _realtime = (b == 0x7F);
+        } else if (i == 3) {
+          _state = (!_realtime && b == 0x01) ? StateDumpProgram : (_realtime && b == 0x02) ? StateChangeProgram : StateIgnore;
+        }
+        break;
+
+      case StateDumpProgram:
+        _checksum ^= b;
+        if (b < 1 || b > Slots) {
+          _reject();
+          break;
+        }
+        _slot = b;
+        // The table is not complete till the checksum is verified.
+        eeprom_update_byte(_validAddress(_slot), 0);
+        _state = StateDumpName;
+        _index = 0;
+        break;
+
+      case StateDumpName:
+        _checksum ^= b;
+        if (_index == 16) {
+          _state = StateDumpData;
+          _index = 0;
+        }
+        break;
+
+      case StateDumpData:
+        _checksum ^= b;
+        _frequency[i % 3] = b;
+        if (i % 3 == 2)
+          _store(i / 3, _frequency[0], _frequency[1], _frequency[2]);
+        if (_index == 128 * 3) {
+          _state = StateDumpChecksum;
+        }
+        break;
+
+      case StateDumpChecksum:
+        if ((_checksum & 0x7F) == b) {
+          eeprom_update_byte(_validAddress(_slot), ValidSlot);
+#if OPL3BOX_STATS
+          accepted++;
+#endif
+          _state = StateDone;
+        } else {
+          _reject();
+        }
+        break;
+
+      case StateChangeProgram:
+        if (b < 1 || b > Slots) {
+          _reject();
+          break;
+        }
+        _slot = b;
+        if (!_isValid(_slot)) {
+          // Starting from the equal temperament in a slot that was never filled.
+          for (uint8_t note = 0; note < 128; note++)
+            eeprom_update_word(_tableAddress(_slot) + note, pgm_read_word(EqualTemperament + note));
+          eeprom_update_byte(_validAddress(_slot), ValidSlot);
+        }
+        _state = StateChangeCount;
+        break;
+
+      case StateChangeCount:
+        _state = StateChangeData;
+        _index = 0;
+        break;
+
+      case StateChangeData:
+        // The note, then its frequency.
+        if (i % 4 == 0) {
+          _note = b;
+        } else {
+          _frequency[i % 4 - 1] = b;
+          if (i % 4 == 3) {
+            _store(_note, _frequency[0], _frequency[1], _frequency[2]);
+#if OPL3BOX_STATS
+            accepted++;
+#endif
+          }
+        }
+        break;
+
+      case StateDone:
+        // Nothing is expected after the checksum.
+        _reject();
+        break;
+
+      case StateIgnore:
+        break;
+    }
+  }
+
+  void sysExEnd() {
+    if (_state != StateDone && _state != StateIgnore && _state != StateChangeData)
+      _reject();
+  }
+
+  /** @} */
+
+protected:
+
+  static const uint8_t ValidSlot = 0xA5;
+
+  enum State : uint8_t {
+    StateHeader,
+    StateDumpProgram,
+    StateDumpName,
+    StateDumpData,
+    StateDumpChecksum,
+    StateChangeProgram,
+    StateChangeCount,
+    StateChangeData,
+    StateDone,
+    StateIgnore
+  };
+
+  State _state;
+  bool _realtime;
+  uint16_t _index;
+  uint8_t _checksum;
+  uint8_t _slot;
+  uint8_t _note;
+  uint8_t _frequency[3];
+
+  /** The table of the selected program. */
+  uint16_t _table[128];
+
+  void _load(uint8_t p) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      program = p;
+      for (uint8_t note = 0; note < 128; note++)
+        _table[note] = (p == 0) ? pgm_read_word(EqualTemperament + note) : eeprom_read_word(_tableAddress(p) + note);
+    }
+  }
+
+  static uint8_t *_selectedAddress() {
+    return (uint8_t *)EEPROMBase;
+  }
+
+  static uint8_t *_validAddress(uint8_t slot) {
+    return (uint8_t *)(EEPROMBase + slot);
+  }
+
+  static uint16_t *_tableAddress(uint8_t slot) {
+    return (uint16_t *)(EEPROMBase + 1 + Slots + (slot - 1) * 256);
+  }
+
+  static bool _isValid(uint8_t p) {
+    return p == 0 || eeprom_read_byte(_validAddress(p)) == ValidSlot;
+  }
+
+  void _store(uint8_t note, uint8_t semitone, uint8_t msb, uint8_t lsb) {
+    if (note > 127)
+      return;
+    uint16_t value;
+    if (semitone == 0x7F && msb == 0x7F && lsb == 0x7F) {
+      // "No change". The notes left unmapped in dumps get the equal temperament, the slot might have never been filled.
+      if (_state != StateDumpData)
+        return;
+      value = pgm_read_word(EqualTemperament + note);
+    } else {
+      value = blockAndFnumberFor(semitone, ((uint16_t)msb << 7) | lsb);
+    }
+    eeprom_update_word(_tableAddress(_slot) + note, value);
+    if (_slot == program) {
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _table[note] = value;
+      }
+    }
+  }
+
+  void _reject() {
+    if (_state >= StateDumpName && _state <= StateDumpChecksum) {
+      eeprom_update_byte(_validAddress(_slot), 0);
+      // The table is half overwritten.
+      if (program == _slot)
+        _load(0);
+    }
+    if (_state != StateIgnore) {
+#if OPL3BOX_STATS
+      rejected++;
+#endif
+    }
+    _state = StateIgnore;
+  }
+};
@@ -72,8 +72,8 @@ struct WaveformValue : OperatorValue {
       )
   { }
   
-  int getValue() { return oplOperator.waveform; }
-  void setValue(int v) { oplOperator.waveform = (OPL3::Waveform) v; }
+  int getValue() { return oplOperator.waveform(); }
+  void setValue(int v) { oplOperator.setWaveform((OPL3::Waveform) v); }
   
 };
 
@@ -107,8 +107,8 @@ struct FrequencyMutliplierValue : OperatorValue {
       )
   { }
     
-  int getValue() { return oplOperator.mult; }
-  void setValue(int v) { oplOperator.mult = v; }
+  int getValue() { return oplOperator.mult(); }
+  void setValue(int v) { oplOperator.setMult(v); }
 };
 
 
@@ -128,8 +128,8 @@ struct EnvScalingValue : OperatorValue {
       )
   { }
   
-  int getValue() { return oplOperator.ksr; }
-  void setValue(int v) { oplOperator.ksr = v; }
+  int getValue() { return oplOperator.ksr(); }
+  void setValue(int v) { oplOperator.setKsr(v); }
 };
 
 struct SustainHoldValue: OperatorValue {
@@ -143,8 +143,8 @@ struct SustainHoldValue: OperatorValue {
       )
   { }
 
-  int getValue() { return oplOperator.egt; }
-  void setValue(int v) { oplOperator.egt = v; }
+  int getValue() { return oplOperator.egt(); }
+  void setValue(int v) { oplOperator.setEgt(v); }
 };
 
 struct VibratoValue : OperatorValue {
@@ -158,8 +158,8 @@ struct VibratoValue : OperatorValue {
       )
     { }
 
-  int getValue() { return oplOperator.vib; }
-  void setValue(int v) { oplOperator.vib = v; }
+  int getValue() { return oplOperator.vib(); }
+  void setValue(int v) { oplOperator.setVib(v); }
 };
 
 struct TremoloValue : OperatorValue {
@@ -173,8 +173,8 @@ struct TremoloValue : OperatorValue {
       )
   { }
   
-  int getValue() { return oplOperator.am; }
-  void setValue(int v) { oplOperator.am = v; }
+  int getValue() { return oplOperator.am(); }
+  void setValue(int v) { oplOperator.setAm(v); }
 };
 
 struct AttackValue : OperatorValue {
@@ -188,8 +188,8 @@ struct AttackValue : OperatorValue {
       )
   { }
   
-  int getValue() { return oplOperator.ar; }
-  void setValue(int v) { oplOperator.ar = v; }
+  int getValue() { return oplOperator.ar(); }
+  void setValue(int v) { oplOperator.setAr(v); }
 };
 
 struct DecayValue : OperatorValue {
@@ -203,8 +203,8 @@ struct DecayValue : OperatorValue {
       )
   { }
 
-  int getValue() { return oplOperator.dr; }
-  void setValue(int v) { oplOperator.dr = v; }
+  int getValue() { return oplOperator.dr(); }
+  void setValue(int v) { oplOperator.setDr(v); }
 };
 
 struct SustainValue : OperatorValue {
@@ -218,8 +218,8 @@ struct SustainValue : OperatorValue {
       )
   { }
 
-  int getValue() { return oplOperator.sl; }
-  void setValue(int v) { oplOperator.sl = v; }
+  int getValue() { return oplOperator.sl(); }
+  void setValue(int v) { oplOperator.setSl(v); }
 };
 
 struct ReleaseValue : OperatorValue {
@@ -234,8 +234,8 @@ struct ReleaseValue : OperatorValue {
 
   { }
   
-  int getValue() { return oplOperator.rr; }
-  void setValue(int v) { oplOperator.rr = v; }
+  int getValue() { return oplOperator.rr(); }
+  void setValue(int v) { oplOperator.setRr(v); }
 };
 
 struct OperatorValues {
@@ -0,0 +1,273 @@
+/**
+ * Voices of the synth, one per 2 operator channel of the chip.
+ *
+ * The state is stored as a structure of arrays of byte sized fields, while free/held/releasing voices are tracked
+ * via bitmasks, so allocation and lookups are a few bit operations over the voices that matter instead of scans
+ * over every voice. With 18 voices the whole table takes 277 bytes on AVR: 14 per voice, 6 bit masks and a counter.
+ */
+template<uint8_t voiceCount>
+class Voices {
+
+public:
+
+  /** A set of voices, one bit per voice. */
+  typedef uint32_t Mask;
+
+  static const uint8_t NoVoice = 0xFF;
+
+  /** For `allocate()` when the patch does not matter. */
+  static const uint8_t AnyPatch = 0xFF;
+
+  static const Mask AllVoices = (voiceCount >= 32) ? ~(Mask)0 : (((Mask)1 << voiceCount) - 1);
+
+  static inline Mask maskFor(uint8_t voice) { return (Mask)1 << voice; }
+
+  /** Index of the lowest voice in the set, which must be non-empty. */
+  static inline uint8_t firstVoice(Mask m) { return __builtin_ctzl(m); }
+
+  /** @{ */
+  /** Per-voice state. */
+
+  /** MIDI channel the voice is playing for. */
+  uint8_t midiChannel[voiceCount];
+
+  /** MIDI note the voice is playing. */
+  uint8_t note[voiceCount];
+
+  /** The key that has started the note, differs from `note` for transposed notes, see `findHeld()`. */
+  uint8_t key[voiceCount];
+
+  /** Velocity of the note. */
+  uint8_t velocity[voiceCount];
+
+  /** Index of the patch the voice is playing, or was playing last: its operator registers still hold it. */
+  uint8_t patch[voiceCount];
+
+  /** The other voice playing the same note in unison, `NoVoice` if none, see `link()`. */
+  uint8_t partner[voiceCount];
+
+  /** Offset of the pitch of the voice from the note, fine steps (see `FinePitch`), used for unison. */
+  int8_t detune[voiceCount];
+
+  /** Polyphonic aftertouch of the note. */
+  uint8_t pressure[voiceCount];
+
+  /** Feedback of the patch of the voice before the aftertouch is applied. */
+  uint8_t feedback[voiceCount];
+
+  /** What is in the A0+/B0+/C0+ registers of the voice's channel. */
+  OPL3::ChannelSetup channel[voiceCount];
+
+  /**
+   * The value of `clock` when the voice was keyed on or off. Only used to compare the ages of voices, so it's OK for it
+   * to be small and wrap, the ages are kept within 255 by `_stamp()`.
+   */
+  uint8_t timestamp[voiceCount];
+
+  /** A rough estimate of how many ticks are left till the release of a voice fades out completely. */
+  uint8_t releaseTicks[voiceCount];
+
+  /** @} */
+
+  /** Voices that are not sounding. */
+  Mask free;
+
+  /** Voices that are keyed on. */
+  Mask held;
+
+  /** Voices that are keyed off, but are still fading out. */
+  Mask releasing;
+
+  /** Free voices set aside for the notes that are about to start, see `reserve()`. */
+  Mask reserved;
+
+  /** Voices taken out of the pool for something else, e.g. the rhythm mode of the chip; never allocated. */
+  Mask withheld;
+
+  /** Held voices playing something less important than the notes, e.g. echoes; stolen before the other held ones. */
+  Mask expendable;
+
+  /** Counts key on/off events, used for the timestamps. */
+  uint8_t clock;
+
+  void begin() {
+    free = AllVoices;
+    held = 0;
+    releasing = 0;
+    reserved = 0;
+    withheld = 0;
+    expendable = 0;
+    clock = 0;
+    for (uint8_t v = 0; v < voiceCount; v++)
+      partner[v] = NoVoice;
+  }
+
+  /**
+   * Picks a voice for a new note: a free one if possible, otherwise the one that has been releasing for the longest time,
+   * otherwise the oldest held one, the `expendable` ones first. Reserved voices are only taken when nothing else is left.
+   * Does not change the state of the voice, see `keyOn()`. The voices in `exclude` are never picked, e.g. the first
+   * voice of a unison pair when picking the second one, as well as the `withheld` ones; at least one voice should be left.
+   *
+   * Among the free voices the ones that played the given patch last are preferred, so its operator registers
+   * do not have to be uploaded again.
+   */
+  uint8_t allocate(Mask exclude = 0, uint8_t patch = AnyPatch) const {
+    Mask candidates = AllVoices & ~exclude & ~withheld;
+    Mask m = free & ~reserved & candidates;
+    if (m) {
+      if (patch != AnyPatch) {
+        for (Mask f = m; f; f &= f - 1) {
+          uint8_t v = firstVoice(f);
+          if (this->patch[v] == patch)
+            return v;
+        }
+      }
+      return firstVoice(m);
+    }
+    m = releasing & candidates;
+    if (m)
+      return oldest(m);
+    m = held & expendable & candidates;
+    if (m)
+      return oldest(m);
+    m = held & candidates;
+    if (m)
+      return oldest(m);
+    return firstVoice(free & candidates);
+  }
+
+  /** 
+   * Sets a free voice aside for a note that is going to start soon, so its registers can be prepared in advance 
+   * without being taken by other notes in the meantime. The reservation ends with `keyOn()` or `unreserve()`.
+   */
+  void reserve(uint8_t v) {
+    reserved |= maskFor(v);
+  }
+
+  void unreserve(uint8_t v) {
+    reserved &= ~maskFor(v);
+  }
+
+  bool isReserved(uint8_t v) const {
+    return reserved & maskFor(v);
+  }
+
+  /** The voice in the set that has changed its state before any other, the set must be non-empty. */
+  uint8_t oldest(Mask m) const {
+    uint8_t result = firstVoice(m);
+    uint8_t maxAge = 0;
+    for (; m; m &= m - 1) {
+      uint8_t v = firstVoice(m);
+      uint8_t age = clock - timestamp[v];
+      if (age > maxAge) {
+        maxAge = age;
+        result = v;
+      }
+    }
+    return result;
+  }
+
+  /** A held voice started by the given key of the given channel, `NoVoice` if there is none. */
+  uint8_t findHeld(uint8_t midiChannel, uint8_t key) const {
+    for (Mask m = held; m; m &= m - 1) {
+      uint8_t v = firstVoice(m);
+      if (this->key[v] == key && this->midiChannel[v] == midiChannel)
+        return v;
+    }
+    return NoVoice;
+  }
+
+  /** Marks the voice as held. A voice stolen from a unison pair leaves it, the other voice is on its own then. */
+  void keyOn(uint8_t v, uint8_t midiChannel, uint8_t key, uint8_t note, uint8_t velocity, uint8_t patch) {
+    _unlink(v);
+    this->midiChannel[v] = midiChannel;
+    this->key[v] = key;
+    this->note[v] = note;
+    this->velocity[v] = velocity;
+    this->patch[v] = patch;
+    this->pressure[v] = 0;
+    _stamp(v);
+    Mask bit = maskFor(v);
+    free &= ~bit;
+    reserved &= ~bit;
+    releasing &= ~bit;
+    held |= bit;
+  }
+
+  /** Marks the held voices as playing the same note in unison, so they are released together. */
+  void link(uint8_t a, uint8_t b) {
+    partner[a] = b;
+    partner[b] = a;
+  }
+
+  /** Marks the voice as releasing, it becomes free after the given number of ticks. */
+  void keyOff(uint8_t v, uint8_t ticks) {
+    _stamp(v);
+    releaseTicks[v] = ticks;
+    Mask bit = maskFor(v);
+    held &= ~bit;
+    releasing |= bit;
+  }
+
+  /** Frees the voice right away, without waiting for its release, e.g. when its channel is taken for something else. */
+  void stop(uint8_t v) {
+    _unlink(v);
+    Mask bit = maskFor(v);
+    held &= ~bit;
+    releasing &= ~bit;
+    reserved &= ~bit;
+    free |= bit;
+  }
+
+  /** Should be called every tick, frees the voices that have finished their release. */
+  void tick() {
+    for (Mask m = releasing; m; m &= m - 1) {
+      uint8_t v = firstVoice(m);
+      if (releaseTicks[v] == 0 || --releaseTicks[v] == 0) {
+        Mask bit = maskFor(v);
+        releasing &= ~bit;
+        free |= bit;
+      }
+    }
+  }
+
+  /**
+   * How many ticks of the given length (ms) it takes for an operator with the given Release Rate to fade out completely,
+   * limited to 255. This is for the lowest notes and ignores Key Scale Rate, i.e. errs on the longer side.
+   */
+  static uint8_t releaseTicksFor(uint8_t rr, uint8_t tickMillis) {
+
+    // Time to go from 0 to -96dB for every Release Rate, halving with every step: RR 15 is about 2.4ms, RR 14 is 4.8ms, etc.
+    // RR 0 means no release at all, but the voice is going to be considered free after the maximum time anyway.
+    if (rr == 0)
+      return 0xFF;
+    uint32_t ms = (uint32_t)2400 << (15 - rr);
+    ms /= 1000;
+    uint32_t ticks = (ms + tickMillis - 1) / tickMillis + 1;
+    return ticks > 0xFF ? 0xFF : ticks;
+  }
+
+protected:
+
+  void _unlink(uint8_t v) {
+    uint8_t p = partner[v];
+    if (p != NoVoice) {
+      partner[p] = NoVoice;
+      partner[v] = NoVoice;
+    }
+  }
+
+  void _stamp(uint8_t v) {
+
+    clock++;
+
+    // Keeping the ages of the voices within the range of the timestamps, so the oldest one can still be found.
+    for (Mask m = held | releasing; m; m &= m - 1) {
+      uint8_t u = firstVoice(m);
+      if ((uint8_t)(clock - timestamp[u]) == 0xFF)
+        timestamp[u]++;
+    }
+
+    timestamp[v] = clock;
+  }
+};
@@ -0,0 +1,376 @@
+/**
+ * Register writes waiting to be sent to the chip, so bursts of them (program changes, edits of patches, etc) don't hold
+ * the main loop and key events don't wait behind them.
+ *
+ * Writes are either urgent (key on/off in B0+ and the rhythm register BD, as well as the rest of the registers written
+ * together with a key event) or bulk (everything else). Only the caller knows whether a write goes with a key event,
+ * so it picks the queue. Urgent writes are always sent first. The order of writes into the same register is preserved:
+ * an urgent write makes pending bulk writes into the same register obsolete, so they are dropped, while bulk writes
+ * following an urgent one are queued after it anyway.
+ *
+ * Writes into a register that is still waiting in the queue replace the pending value instead of taking more room,
+ * except when that would lose a change of the key on (KON) bit of a B0+ register or of the keys of the rhythm
+ * instruments in BD: the chip has to see the key off before the key on to restart the envelopes, see `channelKeyOn()`.
+ */
+template<typename Chip, uint8_t urgentCapacity, uint8_t bulkCapacity>
+class WriteQueue {
+
+public:
+
+  /** Queues a write that should go before any bulk writes, e.g. the f-number of a channel that is about to be keyed on. */
+  void writeUrgent(uint16_t reg, uint8_t value) {
+    _writeUrgent(reg, value, 0);
+  }
+
+  /** Queues a write that can wait till the urgent ones are done. */
+  void writeBulk(uint16_t reg, uint8_t value) {
+
+    if (bulk.coalesce(reg, value)) {
+#if OPL3BOX_STATS
+      stats.coalesced++;
+#endif
+      return;
+    }
+
+    if (bulk.count == bulkCapacity) {
+      // Making room by sending the oldest one, but the urgent ones still go first.
+      _flushUrgent();
+      _writeNextBulk();
+#if OPL3BOX_STATS
+      stats.bulkStalls++;
+#endif
+    }
+    bulk.push(reg, value);
+#if OPL3BOX_STATS
+    if (bulk.count > stats.maxBulkDepth)
+      stats.maxBulkDepth = bulk.count;
+#endif
+  }
+
+  /** Sends all the urgent writes and then up to the given number of bulk ones. Should be called from the main loop. */
+  void drain(uint8_t bulkBudget) {
+    _flushUrgent();
+    while (bulkBudget-- > 0 && bulk.count > 0) {
+      _writeNextBulk();
+    }
+  }
+
+  uint8_t bulkDepth() const { return bulk.count; }
+
+  static const uint8_t BulkCapacity = bulkCapacity;
+
+  /** @{ */
+  /** The counterparts of the functions of the chip queuing the writes instead. */
+
+  /**
+   * Keys the channel on. If the channel is keyed on already (or is going to be by the time the queue is drained),
+   * then it is keyed off first, so the envelopes of the new note restart. The chip needs to see the key off for at least
+   * a sample, so the key on waits for `minKeyOffMicros` after it.
+   */
+  void channelKeyOn(uint8_t index, const typename Chip::ChannelSetup& ch) {
+    uint16_t offset = Chip::offsetForChannel(index);
+    uint16_t flags = _keyOffForRetrigger(index, ch);
+    writeUrgent(0xA0 + offset, ch.regs[0]);
+    writeUrgent(0xC0 + offset, ch.regs[2]);
+    _writeUrgent(0xB0 + offset, ch.regs[1], flags);
+  }
+
+  /**
+   * Keys on the channel, which registers were queued in advance as bulk writes (A0+ and C0+ included), so only B0+
+   * has to be written now. The bulk writes of the channel and its operators that are still waiting go first.
+   */
+  void channelKeyOnPrepared(uint8_t index, const typename Chip::ChannelSetup& ch) {
+    expediteChannel(index);
+    uint16_t flags = _keyOffForRetrigger(index, ch);
+    _writeUrgent(0xB0 + Chip::offsetForChannel(index), ch.regs[1], flags);
+  }
+
+  /**
+   * Keys the channel off ahead of a new note, if it's keyed on, so the registers of the new note can be queued after 
+   * the key off instead of changing the note that is still sounding. The next key on waits for `minKeyOffMicros` 
+   * after it, like in `channelKeyOn()`. Returns true, if the channel was keyed on.
+   */
+  bool channelKeyOffForRetrigger(uint8_t index, const typename Chip::ChannelSetup& ch) {
+    if (!isKeyedOn(index))
+      return false;
+    writeUrgent(0xB0 + Chip::offsetForChannel(index), ch.regs[1] & ~Chip::ChannelSetup::KeyOn::mask);
+    retriggering |= (uint32_t)1 << index;
+#if OPL3BOX_STATS
+    stats.retriggers++;
+#endif
+    return true;
+  }
+
+  void channelKeyOff(uint8_t index, const typename Chip::ChannelSetup& ch) {
+    uint16_t offset = Chip::offsetForChannel(index);
+    writeUrgent(0xB0 + offset, ch.regs[1]);
+  }
+
+  /**
+   * "Quick damp": keys the channel off with the release rates of both operators set to the maximum, so the note fades out
+   * in a couple of milliseconds. Used before retriggering a channel that is still sounding, so the new note starts
+   * from silence without a click. The registers of the new note can be queued right after it, but the release rates 
+   * should be restored only before its key on.
+   */
+  void channelDamp(
+    uint8_t index, const typename Chip::ChannelSetup& ch,
+    const typename Chip::OperatorSetup& op0, const typename Chip::OperatorSetup& op1
+  ) {
+    writeUrgent(0x80 + Chip::offsetForOperator(Chip::operatorForChannel(index, 0)), op0.regs[3] | Chip::OperatorSetup::RR::mask);
+    writeUrgent(0x80 + Chip::offsetForOperator(Chip::operatorForChannel(index, 1)), op1.regs[3] | Chip::OperatorSetup::RR::mask);
+    writeUrgent(0xB0 + Chip::offsetForChannel(index), ch.regs[1] & ~Chip::ChannelSetup::KeyOn::mask);
+    retriggering |= (uint32_t)1 << index;
+#if OPL3BOX_STATS
+    stats.retriggers++;
+#endif
+  }
+
+  /** Moves the bulk writes into the registers of the channel and its operators to the urgent queue, in the same order. */
+  void expediteChannel(uint8_t index) {
+
+    uint16_t channelOffset = Chip::offsetForChannel(index);
+    uint16_t offset0 = Chip::offsetForOperator(Chip::operatorForChannel(index, 0));
+    uint16_t offset1 = Chip::offsetForOperator(Chip::operatorForChannel(index, 1));
+
+    for (uint8_t i = 0, entry = bulk.head; i < bulk.count; i++, entry = bulk.next(entry)) {
+      const typename Chip::RegisterWrite& e = bulk.entries[entry];
+      if (e.reg == Dropped)
+        continue;
+      uint8_t r = e.reg & 0xFF;
+      bool ours;
+      if (r >= 0xA0 && r < 0xD0) {
+        ours = (e.reg & ~0xF0) == channelOffset;
+      } else if (r >= 0x20) {
+        // 20+, 40+, 60+, 80+ and E0+ differ in the top 3 bits only.
+        uint16_t offset = e.reg & ~0xE0;
+        ours = offset == offset0 || offset == offset1;
+      } else {
+        ours = false;
+      }
+      if (ours) {
+        // This drops the bulk entry as well.
+        _writeUrgent(e.reg, e.value, 0);
+#if OPL3BOX_STATS
+        stats.expedited++;
+#endif
+      }
+    }
+  }
+
+  /** True, if the channel is keyed on or is going to be once the queue is drained. */
+  bool isKeyedOn(uint8_t index) const {
+    return keyedOn & ((uint32_t)1 << index);
+  }
+
+  /** @} */
+
+  /** @{ */
+  /** The rhythm mode, see `Chip::Rhythm`. */
+
+  /** The value of the BD register once the queue is drained. */
+  uint8_t rhythm;
+
+  void updateRhythm(uint8_t value) {
+    rhythm = value;
+    writeUrgent(0xBD, value);
+  }
+
+  /** Keys on the rhythm instruments (bits of BD), the ones keyed on already are keyed off first, like in `channelKeyOn()`. */
+  void rhythmKeyOn(uint8_t keys) {
+    uint16_t flags = 0;
+    if (rhythm & keys) {
+      writeUrgent(0xBD, rhythm & ~keys);
+      flags = AfterKeyOffGap;
+#if OPL3BOX_STATS
+      stats.retriggers++;
+#endif
+    }
+    rhythm |= keys;
+    _writeUrgent(0xBD, rhythm, flags);
+  }
+
+  void rhythmKeyOff(uint8_t keys) {
+    updateRhythm(rhythm & ~keys);
+  }
+
+  /** @} */
+
+#if OPL3BOX_STATS
+  struct Stats {
+    /** Bulk writes made obsolete by urgent writes into the same register. */
+    uint16_t droppedBulk;
+    /** How many times the bulk queue was full and a write had to be sent right away. */
+    uint16_t bulkStalls;
+    /** The deepest the bulk queue has been. */
+    uint8_t maxBulkDepth;
+    /** Writes merged into the ones waiting in the queue. */
+    uint16_t coalesced;
+    /** Key ons of the channels that were keyed on already. */
+    uint16_t retriggers;
+    /** Bulk writes prepared for a key on, but not sent by the time of the key on, see `channelKeyOnPrepared()`. */
+    uint16_t expedited;
+  };
+  Stats stats;
+#endif
+
+  /** How long the key off should last before the key on, so the chip notices it. The sample rate is F / 288, i.e. ~20us. */
+  static const uint8_t minKeyOffMicros = 25;
+
+protected:
+
+  /** A register value used to mark dropped entries, no such register exists. */
+  static const uint16_t Dropped = 0xFFFF;
+
+  /** Marks urgent writes that must wait till `minKeyOffMicros` pass since the last key off. */
+  static const uint16_t AfterKeyOffGap = 0x4000;
+
+  static const uint16_t RegisterMask = 0x1FF;
+
+  static inline bool _isKeyOnRegister(uint16_t reg) {
+    uint8_t r = reg & 0xFF;
+    return r >= 0xB0 && r <= 0xB8;
+  }
+
+  /** The bits of the register keying something on: KON of B0+ or the keys of the rhythm instruments in BD. */
+  static inline uint8_t _keyBitsOf(uint16_t reg) {
+    if (reg == 0xBD)
+      return Chip::RhythmKeys;
+    return _isKeyOnRegister(reg) ? Chip::ChannelSetup::KeyOn::mask : 0;
+  }
+
+  template<uint8_t capacity>
+  struct Ring {
+
+    typename Chip::RegisterWrite entries[capacity];
+    uint8_t head;
+    uint8_t count;
+
+    static inline uint8_t next(uint8_t index) {
+      return (index + 1 < capacity) ? index + 1 : 0;
+    }
+
+    static inline uint8_t prev(uint8_t index) {
+      return (index > 0) ? index - 1 : capacity - 1;
+    }
+
+    void push(uint16_t reg, uint8_t value) {
+      uint8_t tail = head + count;
+      if (tail >= capacity)
+        tail -= capacity;
+      entries[tail].reg = reg;
+      entries[tail].value = value;
+      count++;
+    }
+
+    const typename Chip::RegisterWrite& pop() {
+      const typename Chip::RegisterWrite& e = entries[head];
+      head = next(head);
+      count--;
+      return e;
+    }
+
+    /**
+     * Replaces the value of the latest pending write into the same register, if it's safe to do so: 
+     * there should be no key events queued after it and the key bits should not change, see `_keyBitsOf()`.
+     */
+    bool coalesce(uint16_t reg, uint8_t value) {
+      uint8_t index = head + count;
+      if (index >= capacity)
+        index -= capacity;
+      for (uint8_t i = 0; i < count; i++) {
+        index = prev(index);
+        typename Chip::RegisterWrite& e = entries[index];
+        uint16_t r = e.reg & RegisterMask;
+        if (e.reg == Dropped) 
+          continue;
+        if (r == reg) {
+          if ((e.value ^ value) & _keyBitsOf(reg))
+            return false;
+          e.value = value;
+          return true;
+        }
+        if (_keyBitsOf(r))
+          return false;
+      }
+      return false;
+    }
+  };
+
+  Ring<urgentCapacity> urgent;
+  Ring<bulkCapacity> bulk;
+
+  /** Channels that are keyed on, or are going to be once the queue is drained. */
+  uint32_t keyedOn;
+
+  /** When the last key off was written, see `minKeyOffMicros`. */
+  uint16_t keyOffMicros;
+
+  /** Channels keyed off for a retrigger, which key ons have not been queued yet, see `channelKeyOffForRetrigger()`. */
+  uint32_t retriggering;
+
+  /** Keys the channel off, if it's keyed on, so the next key on restarts the envelopes. Returns the flags for the key on. */
+  uint16_t _keyOffForRetrigger(uint8_t index, const typename Chip::ChannelSetup& ch) {
+    channelKeyOffForRetrigger(index, ch);
+    uint32_t bit = (uint32_t)1 << index;
+    if (!(retriggering & bit))
+      return 0;
+    retriggering &= ~bit;
+    return AfterKeyOffGap;
+  }
+
+  void _writeUrgent(uint16_t reg, uint8_t value, uint16_t flags) {
+
+    if (_isKeyOnRegister(reg)) {
+      uint8_t r = reg & 0xFF;
+      uint32_t bit = (uint32_t)1 << (r - 0xB0 + ((reg & 0x100) ? 9 : 0));
+      if (value & Chip::ChannelSetup::KeyOn::mask)
+        keyedOn |= bit;
+      else
+        keyedOn &= ~bit;
+    }
+
+    // Bulk writes into the same register are older, so they would overwrite this one if left in the queue.
+    for (uint8_t i = 0, index = bulk.head; i < bulk.count; i++, index = bulk.next(index)) {
+      if (bulk.entries[index].reg == reg) {
+        bulk.entries[index].reg = Dropped;
+#if OPL3BOX_STATS
+        stats.droppedBulk++;
+#endif
+      }
+    }
+
+    if (urgent.coalesce(reg, value)) {
+#if OPL3BOX_STATS
+      stats.coalesced++;
+#endif
+      return;
+    }
+
+    if (urgent.count == urgentCapacity) {
+      // Not expected to happen often, but cannot wait anyway.
+      _flushUrgent();
+    }
+    urgent.push(reg | flags, value);
+  }
+
+  void _flushUrgent() {
+    while (urgent.count > 0) {
+      const typename Chip::RegisterWrite& e = urgent.pop();
+      uint16_t reg = e.reg & RegisterMask;
+      if (e.reg & AfterKeyOffGap) {
+        while ((uint16_t)((uint16_t)micros() - keyOffMicros) < minKeyOffMicros)
+          ;
+      }
+      Chip::writeIfNeeded(reg, e.value);
+      // Erring on the safe side with BD: any of its instruments not keyed on counts as a key off.
+      if (~e.value & _keyBitsOf(reg))
+        keyOffMicros = micros();
+    }
+  }
+
+  void _writeNextBulk() {
+    const typename Chip::RegisterWrite& e = bulk.pop();
+    if (e.reg != Dropped)
+      Chip::writeIfNeeded(e.reg, e.value);
+  }
+};
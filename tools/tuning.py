@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+#
+# OPL3box. Tuning tables: generates EqualTemperament.h and converts Scala scales into MIDI Tuning Standard SysEx.
+# Copyright (C) 2018, Aleh Dzenisiuk.
+#
+# The sketch keeps a block/f-number pair for every MIDI note, so custom tunings cost the same per note as the default
+# one. The default table is compiled in, the custom ones live in EEPROM and are uploaded via MTS Bulk Tuning Dump
+# SysEx messages, which this script can make from Scala files:
+#
+#   python3 tools/tuning.py table > EqualTemperament.h
+#   python3 tools/tuning.py sysex scale.scl [keyboard.kbm] --program 1 > scale.syx
+#
+# Send the .syx file to the box over USB MIDI (classic MIDI has no flow control, the box cannot keep up with EEPROM
+# writes there), then select the tuning program via RPN 3 (Tuning Program Select), 0 being the equal temperament.
+
+import argparse
+import fractions
+import math
+import sys
+
+# Clock of the chip, see `YM262::F`.
+CHIP_F = 14318180
+
+# The number of tuning programs kept in EEPROM, see `Tunings::Slots`.
+SLOTS = 3
+
+def block_and_fnumber(hz):
+  """The value as stored in the tables: the block in bits 10-12, the f-number in bits 0-9."""
+  f = hz * (1 << 20) / (CHIP_F / 288.0)
+  block = 0
+  while f >= 1023.5 and block < 7:
+    f /= 2
+    block += 1
+  fnumber = min(1023, int(f + 0.5))
+  return (block << 10) | fnumber
+
+def equal_temperament(note):
+  return 440.0 * 2 ** ((note - 69) / 12.0)
+
+def table():
+  out = []
+  out.append('// Generated by tools/tuning.py, do not edit.')
+  out.append('')
+  out.append('/** 12-tone equal temperament, A4 = 440Hz. The block in bits 10-12, the f-number in bits 0-9, see `Tunings`. */')
+  out.append('const uint16_t EqualTemperament[128] PROGMEM = {')
+  for row in range(0, 128, 8):
+    out.append('  ' + ', '.join('0x%04X' % block_and_fnumber(equal_temperament(n)) for n in range(row, row + 8)) + ',')
+  out.append('};')
+  print('\n'.join(out))
+
+def scala_lines(path):
+  """Non-comment lines of a Scala file."""
+  with open(path, encoding='latin-1') as f:
+    for line in f:
+      line = line.rstrip('\r\n')
+      if not line.startswith('!'):
+        yield line
+
+def parse_pitch(text):
+  """Cents for a pitch line of a .scl file: cents have a period, everything else is a ratio."""
+  text = text.strip().split()[0]
+  if '.' in text:
+    return float(text)
+  ratio = fractions.Fraction(text)
+  if ratio <= 0:
+    raise ValueError("Bad ratio: %s" % text)
+  return 1200 * math.log2(ratio)
+
+def read_scl(path):
+  lines = scala_lines(path)
+  description = next(lines).strip()
+  count = int(next(lines).split()[0])
+  pitches = [parse_pitch(next(lines)) for _ in range(count)]
+  return description, pitches
+
+def read_kbm(path):
+  values = [line.split()[0] for line in scala_lines(path) if line.strip()]
+  size = int(values[0])
+  mapping = []
+  for v in values[7:7 + size]:
+    mapping.append(None if v.lower() == 'x' else int(v))
+  # Missing entries at the end are unmapped.
+  mapping += [None] * (size - len(mapping))
+  return {
+    'size': size,
+    'first': int(values[1]),
+    'last': int(values[2]),
+    'middle': int(values[3]),
+    'reference': int(values[4]),
+    'frequency': float(values[5]),
+    'octave': int(values[6]),
+    'map': mapping,
+  }
+
+def default_kbm(pitches):
+  return {
+    'size': 0, 'first': 0, 'last': 127, 'middle': 60, 'reference': 69, 'frequency': 440.0,
+    'octave': len(pitches), 'map': [],
+  }
+
+def scale_degree(kbm, pitches, note):
+  """The scale degree the note is mapped to, relative to the middle note, None if unmapped."""
+  if note < kbm['first'] or note > kbm['last']:
+    return None
+  offset = note - kbm['middle']
+  if kbm['size'] == 0:
+    return offset
+  octave, index = divmod(offset, kbm['size'])
+  degree = kbm['map'][index]
+  if degree is None:
+    return None
+  return degree + octave * kbm['octave']
+
+def degree_cents(pitches, degree):
+  period = pitches[-1]
+  octave, index = divmod(degree, len(pitches))
+  return octave * period + (pitches[index - 1] if index > 0 else 0)
+
+def frequencies(pitches, kbm):
+  reference = scale_degree(kbm, pitches, kbm['reference'])
+  if reference is None:
+    raise ValueError("The reference note is not mapped")
+  result = []
+  for note in range(128):
+    degree = scale_degree(kbm, pitches, note)
+    if degree is None:
+      result.append(None)
+    else:
+      cents = degree_cents(pitches, degree) - degree_cents(pitches, reference)
+      result.append(kbm['frequency'] * 2 ** (cents / 1200))
+  return result
+
+def mts_frequency(hz):
+  """The 3 byte frequency of MTS: the semitone below and 14 bit fraction of a semitone above it."""
+  if hz is None:
+    return [0x7F, 0x7F, 0x7F]
+  semitones = 69 + 12 * math.log2(hz / 440.0)
+  semitones = max(0, min(127 + 16382 / 16384.0, semitones))
+  note = int(semitones)
+  fraction = int(round((semitones - note) * 16384))
+  if fraction == 16384:
+    note += 1
+    fraction = 0
+  if note > 127:
+    note, fraction = 127, 16382
+  return [note, fraction >> 7, fraction & 0x7F]
+
+def bulk_dump(program, name, hz):
+  """MTS Bulk Tuning Dump, non-realtime, to all devices."""
+  body = [0x7E, 0x7F, 0x08, 0x01, program]
+  body += [ord(c) & 0x7F for c in name.ljust(16)[:16]]
+  for f in hz:
+    body += mts_frequency(f)
+  checksum = 0
+  for b in body:
+    checksum ^= b
+  return bytes([0xF0] + body + [checksum & 0x7F, 0xF7])
+
+def sysex(args):
+  description, pitches = read_scl(args.scl)
+  if not pitches:
+    sys.exit("The scale has no pitches")
+  kbm = read_kbm(args.kbm) if args.kbm else default_kbm(pitches)
+  if not 1 <= args.program <= SLOTS:
+    sys.exit("The program should be 1-%d, 0 is the built-in equal temperament" % SLOTS)
+  name = args.name if args.name is not None else description
+  sys.stdout.buffer.write(bulk_dump(args.program, name, frequencies(pitches, kbm)))
+
+def main():
+  parser = argparse.ArgumentParser(description="OPL3box tuning tables")
+  commands = parser.add_subparsers(dest='command')
+  commands.required = True
+  commands.add_parser('table', help="print EqualTemperament.h")
+  p = commands.add_parser('sysex', help="write an MTS Bulk Tuning Dump for a Scala scale to stdout")
+  p.add_argument('scl')
+  p.add_argument('kbm', nargs='?')
+  p.add_argument('--program', type=int, default=1, help="tuning program (EEPROM slot) 1-%d" % SLOTS)
+  p.add_argument('--name', help="16 character name, the description of the scale by default")
+  args = parser.parse_args()
+  if args.command == 'table':
+    table()
+  else:
+    sysex(args)
+
+if __name__ == '__main__':
+  main()